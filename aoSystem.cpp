@@ -1,13 +1,24 @@
 
 
+#include <sstream>
 
 #include <iostream>
 #include <fstream>
+#include <array>
+#include <limits>
+#include <chrono>
+#include <random>
+
+#include <omp.h>
+
+#include <sys/stat.h>
 
 #include <Eigen/Dense>
 
 
 #include <mx/improc/fitsFile.hpp>
+#include <mx/ioutils/binVector.hpp>
+#include <mx/ioutils/stringUtils.hpp>
 #include <mx/math/func/airyPattern.hpp>
 
 #define MX_APP_DEFAULT_configPathGlobal_env "MXAOSYSTEM_GLOBAL_CONFIG"
@@ -15,12 +26,29 @@
 
 #include <mx/app/application.hpp>
 #include <mx/fft/fftwEnvironment.hpp>
+#include <mx/fft/fft.hpp>
 
 #include <mx/ao/analysis/aoSystem.hpp>
 #include <mx/ao/analysis/aoPSDs.hpp>
 #include <mx/ao/analysis/aoWFS.hpp>
 #include <mx/ao/analysis/varmapToImage.hpp>
 #include <mx/ao/analysis/fourierTemporalPSD.hpp>
+#include <mx/ao/analysis/clGainOpt.hpp>
+#include <mx/ao/analysis/linearPredictor.hpp>
+
+#include "contrastCurves.hpp"
+#include "fitsTiles.hpp"
+#include "asyncWriter.hpp"
+#include "bandpass.hpp"
+#include "psdGrid.hpp"
+#include "snapshotIO.hpp"
+#include "taskBudget.hpp"
+#include "numaPlacement.hpp"
+#include "systemSnapshot.hpp"
+#include "errorBudgetBatch.hpp"
+#include "perfSurrogate.hpp"
+#include "paramGradient.hpp"
+#include "streamStats.hpp"
 ///
 /**
   * Star Magnitudes:
@@ -38,6 +66,10 @@ public:
    
    typedef mx::AO::analysis::aoSystem<realT, mx::AO::analysis::vonKarmanSpectrum<realT>> aosysT; ///< The AO system type.
 
+   typedef void (aosysT::*CMapFuncT)(imageT &); ///< Pointer to one of the aoSystem C*Map member functions.
+   
+   typedef realT (aosysT::*CFuncT)(realT, realT, bool); ///< Pointer to one of the aoSystem C* member functions.
+
    /// Default constructor
    mxAOSystem_app(); 
 
@@ -52,17 +84,85 @@ protected:
    mx::AO::analysis::pywfsUnmod<realT> unmodPyWFS; ///< An unmodulated Pyramid WFS 
    mx::AO::analysis::pywfsModAsymptotic<realT> asympModPyWFS; ///< A modulated Pyramid WFS in its asymptotic limit
    
+   std::string wfsType; ///< The name of the WFS in use, from the wfs config.
+   
    realT lam_0;
    
    bool dumpSetup;
    std::string setupOutName;
    
+   bool dryRun; ///< If true, the cost of the mode is estimated instead of calculated.
+   
+   bool configErr; ///< Set by loadConfig on an invalid option, so execute fails before running the mode.
+   
+   std::vector<realT> tauWFSCandidates; ///< WFS integration times [s] from which ErrorBudget chooses the best for each magnitude.  If empty, minTauWFS is used.
+   
+   std::vector<std::string> gradParams; ///< Parameters by which ErrorBudget and the C*Raw curves are differentiated.
+   realT gradStep; ///< The finite difference step, relative to each parameter's value.
+   
+   std::vector<std::string> mcParams; ///< The distribution of each parameter varied by ErrorBudgetMC, as name:dist:a:b.
+   
+   /// The distributions of ErrorBudgetMC parameters.
+   enum mcDist
+   {
+      mcNormal,
+      mcLognormal,
+      mcUniform
+   };
+   
+   int mcSamples; ///< The number of samples drawn by ErrorBudgetMC.
+   int mcSeed; ///< The seed of the ErrorBudgetMC random numbers.
+   std::vector<realT> mcQuantiles; ///< The quantiles reported by ErrorBudgetMC [percent].
+   
+   std::string snapshotOut; ///< If set, a binary snapshot of the configured system is written to this file after a successful run.
+   
    std::string mode;
    
+   int threads; ///< Number of worker threads for all parallel work.  If <= 0 the OpenMP default is used.
+   memoryBudget budget; ///< Limits the memory held by concurrent tasks.
+   
+   bool numaPin; ///< If true, grid workers are pinned to cores spread over the NUMA nodes, and work from node-local copies.
+   numaTopology numa; ///< The NUMA nodes used for pinning.
+   
+   aosysSnapshot<aosysT> sys; ///< Immutable snapshot of the configured system, taken before the mode runs.  Modes derive variants from it instead of changing aosys.
+   
+   asyncWriter writer; ///< Writes output files on a separate thread.
+   int writeQueue; ///< Maximum number of pending output writes.  If 0, writes are synchronous.
+   
+   std::string fitsCompress; ///< Compression of FITS output: none, rice, gzip, or gzip2.
+   realT fitsQuantize; ///< Quantize level for compressed floating point FITS output, 0 for lossless.
+   
    std::string wfeUnits;
    
    int mnMap;
    
+   realT mapOversamp; ///< Sampling of maps [pixels per lambda/D].  Non-integer values are allowed.
+   realT curveOversamp; ///< Sampling of the C*Raw curves [points per lambda/D].
+   
+   bool curveStats; ///< If true, contrast curves from maps are azimuthal statistics in radial bins.  Otherwise they are a row cut of the map.
+   realT curveBinWidth; ///< Width of the radial bins for contrast curves [lambda/D].
+   std::vector<realT> curvePercentiles; ///< Azimuthal percentiles to include in contrast curves, in [0,100].
+   
+   std::string mapRegion; ///< The region of maps to evaluate: full, annulus, wedge, or mask.
+   realT regionIWA; ///< Inner radius of the annulus or wedge region [lambda/D].
+   realT regionOWA; ///< Outer radius of the annulus or wedge region [lambda/D].  If <= 0, the control radius D/d_min/2 is used.
+   realT regionAngle; ///< Central angle of the wedge region, measured from the +m axis [rad].
+   realT regionWidth; ///< Full angular width of the wedge region [rad].
+   std::string regionMask; ///< FITS file containing the region mask, non-zero pixels are evaluated.
+   
+   bool mapProgressive; ///< If true, maps are computed on a coarse lattice first and then adaptively refined.
+   int progStride; ///< Spacing of the initial coarse lattice for progressive maps [pixels].
+   realT progTol; ///< Relative interpolation error below which progressive refinement stops.
+   
+   bandpass<realT> band; ///< The science bandpass.  If not active, lam_sci is monochromatic.
+   realT bandWidth; ///< Full width of a top-hat bandpass centered on lam_sci [m].
+   std::string bandTable; ///< File with columns wavelength [m] and transmission, overrides bandWidth.
+   realT bandTol; ///< Relative tolerance of the adaptive bandpass integration.
+   int bandMaxDepth; ///< Maximum number of times a wavelength interval is halved.
+   
+   int mapTile; ///< If > 0, maps are computed and convolved in tiles of this size [pixels], and streamed to disk.
+   realT psfRadius; ///< Radius at which the PSF is truncated for tiled convolution [lambda/D].
+   
    std::vector<realT> starMags;
    
    realT dfreq;
@@ -71,20 +171,176 @@ protected:
    realT k_n;
    std::string gridDir; ///<The directory for writing the grid of PSDs.
    std::string subDir; ///< The sub-directory of gridDir where to write the analysis results.
-   int lpNc; ///< Number of linear predictor coefficients.  If <= 1 then not used.
+   psdGridFormat gridFormat; ///< How the PSDs in the grid are written.
+   bool gridNormalize; ///< If true, grid PSDs are stored for r_0 = 1 m, to be rescaled at analysis.
+   std::vector<realT> gridR0; ///< The r_0 values [m], at the grid's lam_0, at which to analyze a grid.
+   std::vector<realT> gridWindScale; ///< The wind speed scale factors at which to analyze a grid.
+   bool gridLayers; ///< If true, the PSD of each layer is stored separately, so the grid can be reweighted for any Cn^2 profile.
+   std::vector<realT> gridCn2; ///< The layer weights at which to analyze a layered grid.
+   std::string gridCn2File; ///< A file of layer weights at which to analyze a layered grid, one profile per line.
+   std::vector<int> lpNc; ///< Numbers of linear predictor coefficients to analyze.  Values <= 1 are not used.
+   std::vector<realT> gridDelays; ///< The loop delays [s] at which to analyze a grid.  If empty, deltaTau is used.
    std::vector<int> intTimes; ///< The integration times, in units of minTauWFS, to analyze.
+   
+   std::string surrogateFile; ///< The surrogate table written by the surrogate mode, and read by surrogateQuery.
+   std::vector<realT> surR0; ///< min,max,N of the r_0 axis of the surrogate [m].  If empty, the configured r_0.
+   std::vector<realT> surWind; ///< min,max,N of the mean wind speed axis of the surrogate [m/s].  If empty, the configured v_wind.
+   std::vector<realT> surZeta; ///< min,max,N of the zenith distance axis of the surrogate [rad].  If empty, the configured zeta.
+   std::vector<realT> surLam; ///< min,max,N of the science wavelength axis of the surrogate [m].  If empty, the configured lam_sci.
+   std::vector<realT> surMag; ///< min,max,N of the star magnitude axis of the surrogate.  If empty, the configured starMag.
+   int surrogateCheck; ///< The number of random held-out points at which the surrogate is compared to exact evaluations.
 
    
+   /// The results of analyzing one mode of a PSD grid at one star magnitude.
+   struct modeResult
+   {
+      int m {0};
+      int n {0};
+      realT tau_si {0}; ///< The best integration time for the simple integrator [s]
+      realT gopt_si {0}; ///< The optimal simple integrator gain
+      realT var_si {0}; ///< The residual variance with the simple integrator [rad^2]
+      std::vector<realT> tau_lp; ///< The best integration time for each linear predictor order [s]
+      std::vector<realT> gopt_lp; ///< The optimal gain for each linear predictor order
+      std::vector<realT> var_lp; ///< The residual variance for each linear predictor order [rad^2]
+   };
+   
+   /// Write a binary snapshot of the configured system.
+   /** The snapshot holds every parameter of aosys which a model or loadConfig can set, in the versioned format of snapshotWriter:
+     * - atmosphere: lam_0, r_0, L_0, layer_Cn2, layer_v_wind, layer_dir, layer_z, h_obs, and H,
+     * - PSD: subTipTilt, scintillation, and component,
+     * - system: the WFS type, D, d_min, F0, lam_wfs, npix_wfs, ron_wfs, Fbg, minTauWFS, deltaTau, lam_sci, zeta,
+     *   fit_mn_max, ncp_wfe, ncp_alpha, and starMag,
+     * - the bandpass table.
+     */
+   int saveSnapshot( const std::string & fileName );
+   
+   /// Load a binary snapshot of a configured system, as written by saveSnapshot.
+   /** The file is memory-mapped.  Like a model, this is loaded before the other configuration, which modifies it.
+     * lam_0 is set to the snapshot's, so a configured r_0 or layer_Cn2 is at the same reference wavelength.
+     */
+   int loadSnapshot( const std::string & fileName );
+   
+   /// Report the wall time and throughput of a parallel loop, so runs with different threads and numaPin can be compared.
+   void reportScaling( const std::string & func,
+                       size_t nModes,
+                       int nThreads,
+                       std::chrono::steady_clock::time_point t0
+                     );
+   
+   /// Estimate the cost of the configured mode without running it.
+   /** Counts the evaluations the mode would make, and times a few of them on this machine to estimate the wall time.
+     * The peak memory and the disk output are estimated from the sizes of the arrays and files the mode creates.
+     */
+   int dryRunEstimate();
+   
    virtual void setupConfig();
 
    virtual void loadConfig();
    
    virtual int execute();
    
+   /// Write an image to a FITS file, compressed according to fitsCompress and fitsQuantize.
+   int writeFits( const std::string & fileName,
+                  imageT & im
+                );
+   
+   /// Get the file name for the preview of a progressive map, e.g. C2Map_preview.fits for C2Map.fits
+   std::string previewName( const std::string & mapFile );
+   
+   /// Get the linear size of maps, 2*mnMap*mapOversamp + 1.
+   int mapSize();
+   
+   /// Convolve a contrast map with the PSF to form an image.
+   int C_Convolve( imageT & im,
+                   imageT & map
+                 );
+   
    int C_MapCon( const std::string & mapFile,
                  imageT & map 
                );
-              
+   
+   /// Get the linear indices of the map pixels inside the configured region.
+   int mapRegionPixels( std::vector<size_t> & pix,
+                        int rows,
+                        int cols
+                      );
+   
+   /// Test whether the spatial frequency (m,n) is in the full, annulus, or wedge region.
+   bool inGeomRegion( realT m,
+                      realT n
+                    );
+   
+   /// Evaluate a contrast map, restricted to the configured region.
+   /** If mapRegion is full, the aoSystem map function is used.  Otherwise only
+     * the pixels in the region are evaluated, and the rest are set to 0.
+     */
+   int C_EvalMap( imageT & map,
+                  CMapFuncT mapFunc,
+                  CFuncT Cfunc,
+                  const std::string & previewFile
+                );
+   
+   /// Evaluate a contrast map progressively, starting from a coarse lattice.
+   /** The lattice with spacing progStride is computed first, and its bilinear interpolation is written
+     * to previewFile.  Each lattice cell is then checked at its center and edge midpoints.  If the interpolation
+     * error there is within progTol the cell is filled by interpolation, otherwise it is split in 4 and the
+     * sub-cells are checked in turn.
+     */
+   int C_EvalProgressive( imageT & map,
+                          CFuncT Cfunc,
+                          const std::vector<size_t> & pix,
+                          const std::string & previewFile
+                        );
+   
+   /// Evaluate a contrast map averaged over the bandpass.
+   /** At each wavelength, the pixel at separation (x,y) [lam_sci/D] is at spatial frequency (x,y)*lam_sci/lam.
+     * The bandpass-averaged map is convolved with the PSF at lam_sci.
+     */
+   int C_EvalBand( imageT & map,
+                   CFuncT Cfunc,
+                   const std::vector<size_t> & pix
+                 );
+   
+   /// Calculate a contrast map and convolve it tile-by-tile, streaming the image to mapFile.
+   /** Each output tile is computed from the map over the tile plus a halo of psfRadius, and is convolved
+     * with the PSF truncated at psfRadius by FFT, discarding the wrapped-around halo (overlap-save).  Memory use
+     * is set by mapTile and psfRadius, and not by the map size.  The halo pixels of the map are recomputed for
+     * each tile, so mapTile should be large compared to psfRadius*mapOversamp.  Since the full image is never in
+     * memory, only the azimuthal mean contrast curve is printed.
+     */
+   int C_MapTiled( const std::string & mapFile,
+                   CFuncT Cfunc
+                 );
+   
+   /// Calculate a contrast map, convolve it, and write it to mapFile.
+   int C_Map( const std::string & mapFile,
+              CMapFuncT mapFunc,
+              CFuncT Cfunc
+            );
+   
+   /// Print the contrast curves of one or more convolved images.
+   /** With curveStats these are the azimuthal statistics, and all images must have the same size, as the radial bin index is
+     * shared.  Otherwise each is the row cut of writeRowCut, preceded by "#name" if there is more than one.
+     */
+   int writeCurves( std::ostream & out,
+                    const std::vector<std::string> & names,
+                    const std::vector<imageT> & ims
+                  );
+   
+   /// Print the lines "i value" along the row above the center of a map, for i = 0 to mnMap-1.
+   /** This is the contrast curve printed by the C*Map modes without curveStats.  Point i is sampled i*mapOversamp
+     * pixels to the right of the pixel diagonally above the center.
+     */
+   void writeRowCut( std::ostream & out,
+                     const std::vector<realT> & row ///< [in] the whole row above the center
+                   );
+   
+   /// Print one or more contrast terms along the m axis, sampled at curveOversamp.
+   /** If gradParams is set, each line continues with the derivatives of the terms by the first parameter, then by the
+     * second, and so on.
+     */
+   int C_Raw( const std::vector<CFuncT> & Cfuncs );
+   
    int C0Raw();
    int C0Map();
    
@@ -104,16 +360,170 @@ protected:
    int C7Map();
    
    int CAllRaw();
+   int CAllMap();
    
    int ErrorBudget();
    
+   /// Get the parameters named by gradParams.
+   int gradParamList( std::vector<sysParam<realT, aosysT>> & params );
+   
+   /// Print the derivatives of the error budget of each magnitude by each of gradParams.
+   /** The derivatives are of the quantities ErrorBudget prints: the RMS of each term in wfeUnits, and the Strehl ratio.
+     * If tauWFSCandidates is set, each magnitude is differentiated at its chosen integration time.  Since that time
+     * minimizes the residual, this is also the derivative of the optimized budget.
+     */
+   int ErrorBudgetGradient( const std::vector<realT> & mags,
+                            const std::vector<realT> & bestTau
+                          );
+   
+   /// Propagate the uncertainties of parameters to the error budget by Monte Carlo.
+   /** Each entry of mcParams is name:dist:a:b, where dist is normal (a mean, b standard deviation), lognormal (a median,
+     * b standard deviation of the log), or uniform (a min, b max), and name is a parameter which gradParams accepts.
+     * These are the parameters of findSysParam, not every config key.  In particular v_wind scales the speeds of all
+     * layers together, and the parameters of single layers can not be varied.  Normal draws of parameters which can
+     * not be negative are redrawn until positive, so their mean must be > 0, and their uniform ranges must start at >= 0.
+     *
+     * The samples are drawn in blocks, each with its own generator seeded from mcSeed and the block index, and evaluated
+     * in parallel on per-thread copies of the system.  The results are fed to streaming statistics in sample order, a
+     * chunk of blocks at a time, so memory does not grow with mcSamples, and the output is the same for any number of threads.
+     * For each magnitude, the mean, standard deviation, range, and mcQuantiles of each printed term are reported.
+     */
+   int ErrorBudgetMC();
+   
+   /// The error budget averaged over the bandpass.
+   /** The measurement, time-delay, and fitting errors scale as lam^-2, so they are calculated once.
+     * The remaining terms are calculated at each wavelength.  gradParams is not supported, and loadConfig rejects it.
+     */
+   int ErrorBudgetBand();
+   
    int Strehl();
    
    int temporalPSD();
    
+   /// Calculate the temporal PSD of each spatial frequency and write the grid to dir.
+   /** Writes params.txt, freq.binv, and a PSD file for each (m,n) with |m|,|n| <= mnMax in the half-plane m > 0, or
+     * m = 0 and n > 0, in the format set by gridFormat.  In binv format and double precision these are the files, names, and
+     * layout of fourierTemporalPSD::makePSDGrid, so the library reads the grid as its own.  format.txt records the format
+     * and the r_0 of the grid, and is ignored by the library.  Each PSD is calculated by the library, in parallel, and
+     * written by the writer thread.
+     *
+     * For float precision, the precision lost by each mode is written to precision.txt: the maximum relative error
+     * of the stored PSD, the relative error of its integrated variance, and the number of values outside the float
+     * normal range.
+     */
+   int makePSDGrid( const std::string & dir,
+                    int mnMax,
+                    realT dFreq,
+                    realT maxFreq,
+                    realT fmax
+                  );
+   
    int temporalPSDGrid();
    
+   /// Fold a PSD into the band [0, fs/2] of a loop sampling at fs.
+   /** The output frequencies are those of freq up to fs/2, and the power above fs/2 is aliased back into the band.
+     */
+   void foldPSD( std::vector<realT> & tfreq,
+                 std::vector<realT> & tpsd,
+                 const std::vector<realT> & freq,
+                 const std::vector<realT> & psd,
+                 realT fs
+               );
+   
+   /// Find the optimal gains and residuals for the PSD of one mode, choosing the best of intTimes.
+   /** Each step is the library's, as in fourierTemporalPSD::analyzePSDGrid.  The measurement noise at each integration
+     * time tau is lsys.measurementError(m,n) with the WFS fixed at tau, spread as a white one-sided PSD over [0, fs/2],
+     * so that it integrates to that variance.  The gains are optimized by clGainOpt::optGainOpenLoop, and the linear
+     * predictor coefficients of each order in lpNc are found and regularized by linearPredictor::regularizeCoefficients.
+     * Each loop delay is evaluated on the same folded PSD.  lsys is left with its WFS fixed at the last of intTimes.
+     */
+   int analyzeModePSD( std::vector<modeResult> & res, ///< [out] the results for each delay
+                       aosysT & lsys,
+                       std::vector<realT> & freq,
+                       std::vector<realT> & psd,
+                       int m,
+                       int n,
+                       const std::vector<int> & lpNc,
+                       const std::vector<realT> & delays, ///< [in] the loop delays to evaluate [s]
+                       const std::vector<int> & intTimes
+                     );
+   
+   /// Write the results of a grid analysis as a cube of (m,n) maps.
+   /** The planes are gopt_si, var_si, and tau_si, then gopt_lp, var_lp, tau_lp, and the ratio var_si/var_lp for each
+     * linear predictor order.  Pixel (mc+m, mc+n) holds mode (m,n), where mc is the largest controlled index, and
+     * (-m,-n) holds the same values.  The plane names are in the PLANE<i> keywords.  The cube is written uncompressed
+     * in a single write by the writer thread, so it can be memory-mapped.
+     */
+   void writeModeMaps( const std::string & fileName,
+                       const std::vector<std::array<int,2>> & mn,
+                       const std::vector<const modeResult *> & res,
+                       const std::vector<int> & orders
+                     );
+   
+   /// An atmospheric condition at which a stored grid is analyzed.
+   struct gridCondition
+   {
+      realT r_0; ///< Fried's parameter at the grid's lam_0 [m], or 0 to keep the configured value.
+      realT psdScale; ///< Factor applied to the stored PSDs.
+      realT windScale; ///< Factor applied to every layer wind speed, by resampling the stored PSDs.
+      std::string dir; ///< The results directory, relative to the grid directory.
+      std::vector<realT> cn2; ///< The Cn^2 weight of each layer of a layered grid, empty for the grid's own weights.
+   };
+   
+   /// Analyze a grid of PSDs, finding the optimal gains and residuals of each controlled mode at each magnitude and condition.
+   /** The PSDs are read with readGridPSD, so any grid format written by makePSDGrid can be analyzed, and
+     * the analysis is always in realT precision.  Each PSD is read once and rescaled for each condition.  Since
+     * the PSDs of (m,n) and (-m,-n) are the same, only the half-plane m > 0, or m = 0 and n > 0, is analyzed.
+     * For each condition and magnitude, psdDir/dir/modes_<mag>.dat lists the results of each mode.  If delayDirs is true,
+     * the results for each delay are in psdDir/dir/delay_<deltaTau>/modes_<mag>.dat.  The same results are written as
+     * (m,n) maps to maps_<mag>.fits, by writeModeMaps.
+     *
+     * This is used only for grids and options the library's fourierTemporalPSD::analyzePSDGrid does not support.
+     */
+   int analyzePSDGrid( std::vector<gridCondition> & conds,
+                       const std::string & psdDir,
+                       int mnMax,
+                       int mnCon,
+                       const std::vector<int> & lpNc,
+                       const std::vector<realT> & delays,
+                       bool delayDirs,
+                       std::vector<realT> & mags,
+                       std::vector<int> & intTimes
+                     );
+   
+   /// Analyze the grid of PSDs in gridDir.
+   /** A double precision binv grid, analyzed without gridR0, gridWindScale, gridCn2, gridCn2File, gridDelays, or more than one
+     * lpNc order, is analyzed by fourierTemporalPSD::analyzePSDGrid, with its output layout.  If numaPin is set, the
+     * threads of the OpenMP pool are pinned before the library's loop runs on them.  Other grids (FITS, float,
+     * normalized, or layered) and options are analyzed by analyzePSDGrid.
+     */
    int temporalPSDGridAnalyze();
+   
+   /// Set up an empty surrogate table on the hypercube given by the surR0, surWind, surZeta, surLam, and surMag ranges.
+   /** The axes are r_0, v_wind, zeta, lam_sci, and starMag, in that order, and the outputs are the seven error
+     * variances of errorBudgetBatch, interpolated in log space.
+     */
+   int surrogateSetup( perfSurrogate<realT> & sur );
+   
+   /// Calculate the error budgets at the star magnitudes of one (r_0, v_wind, zeta, lam_sci) point of the surrogate hypercube.
+   int surrogateExact( Eigen::Array<realT, -1, -1> & terms, ///< [out] ebNTerms x mags.size(), as filled by errorBudgetBatch
+                       const realT * x,                     ///< [in] r_0, v_wind, zeta, and lam_sci
+                       const std::vector<realT> & mags      ///< [in] the star magnitudes
+                     );
+   
+   /// Sample the error budget over the surrogate hypercube and write the table to surrogateFile.
+   /** The points are calculated in parallel, each star magnitude axis with one errorBudgetBatch, so the WFS integration time is
+     * optimized when tauWFSList or tauWFSRange is set.  The table is then compared to exact evaluations at surrogateCheck
+     * random points inside the hypercube, and the errors and the time per query are reported.
+     */
+   int surrogate();
+   
+   /// Answer queries of a surrogate table, one per line of stdin, until end of input.
+   /** Each line holds r_0, v_wind, zeta, lam_sci, and starMag, and the reply is a line with the Strehl ratio and the RMS of each
+     * term in wfeUnits, then 1 if the point was clamped to the table or else 0.  Replies are flushed, so a scheduler can hold the
+     * process open on a pipe.
+     */
+   int surrogateQuery();
 };
 
 template<typename realT>
@@ -122,11 +532,28 @@ mxAOSystem_app<realT>::mxAOSystem_app()
    lam_0 = 0;
    
    dumpSetup = true;
+   
+   dryRun = false;
+   configErr = false;
+   gradStep = 1e-4;
+   
+   mcSamples = 10000;
+   mcSeed = 1;
+   mcQuantiles = {5, 50, 95};
    setupOutName = "mxAOAnalysisSetup.txt";
    
    mode = "C2Raw";
    
+   threads = 0;
+   numaPin = false;
+   
+   writeQueue = 16;
+   
+   fitsCompress = "none";
+   fitsQuantize = 0;
+   
    aosys.wfsBeta( idealWFS );
+   wfsType = "ideal";
    
    wfeUnits = "rad";
    
@@ -134,12 +561,39 @@ mxAOSystem_app<realT>::mxAOSystem_app()
    
    mnMap = 50;
    
+   mapOversamp = 1;
+   curveOversamp = 1;
+   
+   curveStats = false;
+   curveBinWidth = 1;
+   
+   mapRegion = "full";
+   regionIWA = 0;
+   regionOWA = 0;
+   regionAngle = 0;
+   regionWidth = 0;
+   
+   mapProgressive = false;
+   progStride = 8;
+   progTol = 0.01;
+   
+   bandWidth = 0;
+   bandTol = 1e-3;
+   bandMaxDepth = 6;
+   
+   mapTile = 0;
+   psfRadius = 32;
+   
    dfreq = 0.1;
    kmax = 0;
    k_m = 1;
    k_n = 0;
-   lpNc = 0;
+   lpNc = {0};
+   gridNormalize = false;
+   gridLayers = false;
    intTimes = {1};
+   
+   surrogateCheck = 200;
 }
 
 template<typename realT>
@@ -147,16 +601,214 @@ mxAOSystem_app<realT>::~mxAOSystem_app()
 {
 }   
 
+template<typename realT>
+int mxAOSystem_app<realT>::saveSnapshot( const std::string & fileName )
+{
+   snapshotWriter sw(sizeof(realT));
+   
+   //Atmosphere
+   sw.put(aosys.atm.lam_0());
+   sw.put(aosys.atm.r_0());
+   sw.put(aosys.atm.L_0());
+   sw.put(aosys.atm.layer_Cn2());
+   sw.put(aosys.atm.layer_v_wind());
+   sw.put(aosys.atm.layer_dir());
+   sw.put(aosys.atm.layer_z());
+   sw.put(aosys.atm.h_obs());
+   sw.put(aosys.atm.H());
+   
+   //PSD
+   sw.put<char>(aosys.psd.subTipTilt());
+   sw.put<char>(aosys.psd.scintillation());
+   sw.put<int>( (int) aosys.psd.component());
+   
+   //System
+   sw.put(wfsType);
+   sw.put(aosys.D());
+   sw.put(aosys.d_min());
+   sw.put(aosys.F0());
+   sw.put(aosys.lam_wfs());
+   sw.put(aosys.npix_wfs());
+   sw.put(aosys.ron_wfs());
+   sw.put(aosys.Fbg());
+   sw.put(aosys.minTauWFS());
+   sw.put(aosys.deltaTau());
+   sw.put(aosys.lam_sci());
+   sw.put(aosys.zeta());
+   sw.put(aosys.fit_mn_max());
+   sw.put(aosys.ncp_wfe());
+   sw.put(aosys.ncp_alpha());
+   sw.put(aosys.starMag());
+   
+   //Bandpass table
+   sw.put(band.lam);
+   sw.put(band.trans);
+   
+   return sw.write(fileName);
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::loadSnapshot( const std::string & fileName )
+{
+   snapshotReader sr;
+   if(sr.open(fileName, sizeof(realT)) < 0) return -1;
+   
+   //Everything is read before anything is applied, so a truncated file leaves aosys unchanged
+   realT lam0, r0, L0, h_obs, H;
+   std::vector<realT> cn2, vWind, dir, z;
+   char subTipTilt = 0, scint = 0;
+   int comp = 0;
+   std::string wfs;
+   realT D, d_min, F0, lam_wfs, npix_wfs, ron_wfs, Fbg, minTauWFS, deltaTau, lam_sci, zeta, fit_mn_max, ncp_wfe, ncp_alpha, starMag;
+   std::vector<realT> bandLam, bandTrans;
+   
+   //Atmosphere
+   sr.get(lam0);
+   sr.get(r0);
+   sr.get(L0);
+   sr.get(cn2);
+   sr.get(vWind);
+   sr.get(dir);
+   sr.get(z);
+   sr.get(h_obs);
+   sr.get(H);
+   
+   //PSD
+   sr.get(subTipTilt);
+   sr.get(scint);
+   sr.get(comp);
+   
+   //System
+   sr.get(wfs);
+   sr.get(D);
+   sr.get(d_min);
+   sr.get(F0);
+   sr.get(lam_wfs);
+   sr.get(npix_wfs);
+   sr.get(ron_wfs);
+   sr.get(Fbg);
+   sr.get(minTauWFS);
+   sr.get(deltaTau);
+   sr.get(lam_sci);
+   sr.get(zeta);
+   sr.get(fit_mn_max);
+   sr.get(ncp_wfe);
+   sr.get(ncp_alpha);
+   sr.get(starMag);
+   
+   //Bandpass table
+   sr.get(bandLam);
+   sr.get(bandTrans);
+   
+   if(sr.bad())
+   {
+      std::cerr << "loadSnapshot: " << fileName << " is truncated\n";
+      return -1;
+   }
+   
+   //Atmosphere.  Cn2 before r_0, so r_0 sets the normalization.
+   aosys.atm.L_0(L0);
+   aosys.atm.layer_Cn2(cn2, lam0);
+   aosys.atm.r_0(r0, lam0);
+   aosys.atm.layer_v_wind(vWind);
+   aosys.atm.layer_dir(dir);
+   aosys.atm.layer_z(z);
+   aosys.atm.h_obs(h_obs);
+   aosys.atm.H(H);
+   
+   //The reference wavelength of any r_0 or layer_Cn2 configured after this
+   lam_0 = lam0;
+   
+   //PSD
+   aosys.psd.subTipTilt(subTipTilt);
+   aosys.psd.scintillation(scint);
+   aosys.psd.component( (mx::AO::analysis::PSDComponent) comp);
+   
+   //System
+   wfsType = wfs;
+   if(wfsType == "unmodPyWFS") aosys.wfsBeta(unmodPyWFS);
+   else if(wfsType == "asympModPyWFS") aosys.wfsBeta(asympModPyWFS);
+   else aosys.wfsBeta(idealWFS);
+   
+   aosys.D(D);
+   aosys.d_min(d_min);
+   aosys.F0(F0);
+   aosys.lam_wfs(lam_wfs);
+   aosys.npix_wfs(npix_wfs);
+   aosys.ron_wfs(ron_wfs);
+   aosys.Fbg(Fbg);
+   aosys.minTauWFS(minTauWFS);
+   aosys.deltaTau(deltaTau);
+   aosys.lam_sci(lam_sci);
+   aosys.zeta(zeta);
+   aosys.fit_mn_max(fit_mn_max);
+   aosys.ncp_wfe(ncp_wfe);
+   aosys.ncp_alpha(ncp_alpha);
+   aosys.starMag(starMag);
+   
+   band.lam = bandLam;
+   band.trans = bandTrans;
+   
+   return 0;
+}
+
 template<typename realT>
 void mxAOSystem_app<realT>::setupConfig()
 {
    //App config
    config.add("mode"        ,"m", "mode" , mx::argType::Required, "", "mode",     false,  "string", "Mode of calculation: C2Raw, C2Map, ErrorBudget, Strehl");
+   config.add("tauWFSList"      ,"", "tauWFSList" , mx::argType::Required, "", "tauWFSList", false, "real vector", "WFS integration times [s] from which ErrorBudget chooses the one minimizing the residual for each magnitude.  Every mode uses the chosen time, rather than the library's optimum above minTauWFS.");
+   config.add("tauWFSRange"     ,"", "tauWFSRange" , mx::argType::Required, "", "tauWFSRange", false, "real vector", "min,max,N: N logarithmically spaced WFS integration times [s] from which ErrorBudget chooses for each magnitude.");
+   config.add("gradParams"      ,"", "gradParams" , mx::argType::Required, "", "gradParams", false, "string vector", "Parameters by which to differentiate ErrorBudget and the C*Raw curves, e.g. d_min,r_0,minTauWFS.");
+   config.add("gradStep"        ,"", "gradStep" , mx::argType::Required, "", "gradStep", false, "real", "Finite difference step for gradParams, relative to each parameter's value.  Default is 1e-4.");
+   config.add("mcParams"        ,"", "mcParams" , mx::argType::Required, "", "mcParams", false, "string vector", "Parameter distributions for ErrorBudgetMC, each name:dist:a:b with dist normal (mean,sd), lognormal (median,sd of log), or uniform (min,max).  name is one of the gradParams parameters: D, d_min, r_0, L_0, v_wind (all layers together), F0, lam_wfs, ron_wfs, Fbg, minTauWFS, deltaTau, lam_sci, zeta, ncp_wfe, ncp_alpha, starMag.");
+   config.add("mcSamples"       ,"", "mcSamples" , mx::argType::Required, "", "mcSamples", false, "int", "Number of samples drawn by ErrorBudgetMC.  Default is 10000.");
+   config.add("mcSeed"          ,"", "mcSeed" , mx::argType::Required, "", "mcSeed", false, "int", "Seed of the ErrorBudgetMC random numbers.  Default is 1.");
+   config.add("mcQuantiles"     ,"", "mcQuantiles" , mx::argType::Required, "", "mcQuantiles", false, "real vector", "Quantiles reported by ErrorBudgetMC [percent].  Default is 5,50,95.");
+   config.add("dryRun"          ,"", "dry-run" , mx::argType::True, "", "dryRun", false, "bool", "Estimate the evaluations, wall time, memory, and disk use of the mode without running it.");
+   config.add("snapshot"        ,"", "snapshot" , mx::argType::Required, "", "snapshot", false, "string", "Binary snapshot of a configured system to load at startup, instead of a model.  Other options modify it.");
+   config.add("snapshotOut"     ,"", "snapshotOut" , mx::argType::Required, "", "snapshotOut", false, "string", "File to write a binary snapshot of the configured system to after the run.");
    config.add("setupOutFile"        ,"", "setupOutFile" , mx::argType::Required, "", "setupOutFile", false, "string", "Filename for output of setup data");
 
+   config.add("threads"           ,"", "threads" , mx::argType::Required, "", "threads", false, "int", "Number of worker threads for all parallel work.  Default is the OpenMP default, usually the number of cores.");
+   config.add("maxMemory"         ,"", "max-memory" , mx::argType::Required, "", "maxMemory", false, "string", "Memory budget, with optional K, M, G, or T suffix.  temporalPSDGrid waits for written PSDs to free it.  Maps, grid analysis, and surrogate tables larger than it are refused, as is a bandpass integral which outgrows it.  ErrorBudgetMC shrinks its sample chunk to fit.  Default is unlimited.");
+   config.add("numaPin"           ,"", "numaPin" , mx::argType::Required, "", "numaPin", false, "bool", "If true, grid workers are pinned to cores spread over the NUMA nodes and use node-local copies of the system and frequencies.  Default is false.");
+   config.add("writeQueue"        ,"", "writeQueue" , mx::argType::Required, "", "writeQueue", false, "int", "Maximum number of output writes pending on the writer thread.  If 0, writes are synchronous.  Default is 16.");
+
+   config.add("compress"          ,"", "compress" , mx::argType::Required, "output", "compress", false, "string", "Compression of FITS output: none [default], rice, gzip, or gzip2.");
+   config.add("quantize"          ,"", "quantize" , mx::argType::Required, "output", "quantize", false, "real", "Quantize level for compressed floating point FITS output.  0 [default] is lossless, > 0 is relative to the noise, < 0 is the absolute step.");
+
    config.add("wfeUnits"        ,"", "wfeUnits" , mx::argType::Required, "", "wfeUnits", false, "string", "Units for WFE in ErrorBudget: rad or nm");
 
    config.add("mnMap"        ,"", "mnMap" , mx::argType::Required, "", "mnMap",     false,  "string", "Maximum spatial frequency index to include in maps.");
+   config.add("mapOversamp"      ,"", "mapOversamp" , mx::argType::Required, "", "mapOversamp",    false,  "real", "Sampling of maps [pixels per lambda/D].  Default is 1.");
+   config.add("curveOversamp"    ,"", "curveOversamp" , mx::argType::Required, "", "curveOversamp",  false,  "real", "Sampling of C*Raw curves [points per lambda/D].  Default is 1.");
+   config.add("curveStats"       ,"", "curveStats" , mx::argType::Required, "", "curveStats",       false,  "bool", "If true, contrast curves from maps are printed as a table of sep, mean, median, and curvePercentiles in radial bins, or only sep and mean with mapTile.  Default is false, which prints the lines \"i value\" along the row above the map center.");
+   config.add("curveBinWidth"    ,"", "curveBinWidth" , mx::argType::Required, "", "curveBinWidth",    false,  "real", "Width of radial bins for contrast curves from maps [lambda/D].");
+   config.add("curvePercentiles" ,"", "curvePercentiles" , mx::argType::Required, "", "curvePercentiles", false,  "real vector", "Azimuthal percentiles to include in contrast curves from maps, in [0,100].");
+   
+   //Map region
+   config.add("mapRegion"    ,"", "mapRegion"   , mx::argType::Required, "region", "mapRegion",   false, "string", "Region of maps to evaluate: full [default], annulus, wedge, or mask.");
+   config.add("regionIWA"    ,"", "regionIWA"   , mx::argType::Required, "region", "regionIWA",   false, "real", "Inner radius of the annulus or wedge [lambda/D]");
+   config.add("regionOWA"    ,"", "regionOWA"   , mx::argType::Required, "region", "regionOWA",   false, "real", "Outer radius of the annulus or wedge [lambda/D].  Default is the control radius D/d_min/2.");
+   config.add("regionAngle"  ,"", "regionAngle" , mx::argType::Required, "region", "regionAngle", false, "real", "Central angle of the wedge, from the +m axis [rad]");
+   config.add("regionWidth"  ,"", "regionWidth" , mx::argType::Required, "region", "regionWidth", false, "real", "Full angular width of the wedge [rad]");
+   config.add("regionMask"   ,"", "regionMask"  , mx::argType::Required, "region", "regionMask",  false, "string", "FITS file with the region mask, same size as the map.  Non-zero pixels are evaluated.");
+   
+   //Progressive maps
+   config.add("mapProgressive" ,"", "mapProgressive", mx::argType::Required, "progressive", "mapProgressive", false, "bool", "If true, maps are computed on a coarse lattice, a preview is written, and then refined adaptively.");
+   config.add("progStride"     ,"", "progStride"    , mx::argType::Required, "progressive", "progStride",     false, "int", "Spacing of the initial coarse lattice [pixels].  Default is 8.");
+   config.add("progTol"        ,"", "progTol"       , mx::argType::Required, "progressive", "progTol",        false, "real", "Relative interpolation error at which refinement stops.  Default is 0.01.");
+   
+   //Bandpass
+   config.add("bandWidth"    ,"", "bandWidth"    , mx::argType::Required, "bandpass", "bandWidth",    false, "real", "Full width of a top-hat science bandpass centered on lam_sci [m].  If 0 [default], lam_sci is monochromatic.");
+   config.add("bandTable"    ,"", "bandTable"    , mx::argType::Required, "bandpass", "bandTable",    false, "string", "File with columns wavelength [m] and transmission.  Overrides bandWidth.");
+   config.add("bandTol"      ,"", "bandTol"      , mx::argType::Required, "bandpass", "bandTol",      false, "real", "Relative tolerance of the bandpass integration.  Default is 1e-3.");
+   config.add("bandMaxDepth" ,"", "bandMaxDepth" , mx::argType::Required, "bandpass", "bandMaxDepth", false, "int", "Maximum number of times a wavelength interval is halved.  Default is 6.");
+   
+   //Tiled maps
+   config.add("mapTile"      ,"", "mapTile"   , mx::argType::Required, "tiled", "mapTile",   false, "int", "If > 0, maps are computed and convolved in tiles of this size [pixels] and streamed to disk.");
+   config.add("psfRadius"    ,"", "psfRadius" , mx::argType::Required, "tiled", "psfRadius", false, "real", "Radius at which the PSF is truncated for tiled convolution [lambda/D].  Default is 32.");
    
    //Load a model
    config.add("model"        ,"", "model" , mx::argType::Required, "", "model", false, "string", "Model to load: Guyon2005, MagAOX, or GMagAOX");
@@ -205,9 +857,27 @@ void mxAOSystem_app<realT>::setupConfig()
    config.add("k_n"     ,"", "k_n"    , mx::argType::Required,  "temporal", "k_n",     false, "real", "The spatial frequency n index.");
    config.add("gridDir"     ,"", "gridDir"    , mx::argType::Required,  "temporal", "gridDir",     false, "string", "The directory to store the grid of PSDs.");
    config.add("subDir"     ,"", "subDir"    , mx::argType::Required,  "temporal", "subDir",     false, "string", "The directory to store the analysis results.");
-   config.add("lpNc"      ,"", "lpNc",    mx::argType::Required,  "temporal", "lpNc",     false, "int", "The number of linear prediction coefficients to use (if <= 1 ignored)");      
+   config.add("gridFormat"     ,"", "gridFormat"    , mx::argType::Required,  "temporal", "gridFormat",     false, "string", "Format of the PSD grid files: binv [default] or fits.  FITS grids use the [output] compression.");
+   config.add("gridPrecision"  ,"", "gridPrecision" , mx::argType::Required,  "temporal", "gridPrecision",  false, "string", "Storage precision of the PSD grid files: double [default] or float.  Analysis is always in double.");
+   config.add("gridNormalize"  ,"", "gridNormalize" , mx::argType::Required,  "temporal", "gridNormalize",  false, "bool", "If true, grid PSDs are stored for r_0 = 1 m, and rescaled to the r_0 given at analysis.  Default is false.");
+   config.add("gridR0"         ,"", "gridR0"        , mx::argType::Required,  "temporal", "gridR0",         false, "real vector", "The r_0 values [m], at the grid's lam_0, at which to analyze a grid.  Results for each are in subDir/r0_<r_0>.  Default is the configured r_0.");
+   config.add("gridWindScale"  ,"", "gridWindScale" , mx::argType::Required,  "temporal", "gridWindScale",  false, "real vector", "Factors by which to scale every layer wind speed when analyzing a grid, by resampling the stored PSDs.  Results for each are in .../wind_<scale>.");
+   config.add("gridLayers"     ,"", "gridLayers"    , mx::argType::Required,  "temporal", "gridLayers",     false, "bool", "If true, the PSD of each layer is stored separately, so the grid can be reweighted for any Cn2 profile at analysis.  Default is false.");
+   config.add("gridCn2"        ,"", "gridCn2"       , mx::argType::Required,  "temporal", "gridCn2",        false, "real vector", "The Cn2 weight of each layer at which to analyze a layered grid, normalized to sum to 1.  Default is the grid's own profile.");
+   config.add("gridCn2File"    ,"", "gridCn2File"   , mx::argType::Required,  "temporal", "gridCn2File",    false, "string", "A file of Cn2 profiles at which to analyze a layered grid, one line of layer weights per profile, each normalized to sum to 1.  Results for each are in subDir/cn2_<line>, where <line> is its line number in the file.");
+   config.add("lpNc"      ,"", "lpNc",    mx::argType::Required,  "temporal", "lpNc",     false, "int vector", "The numbers of linear prediction coefficients to analyze, all in one pass (if <= 1 ignored)");      
+   config.add("gridDelays"     ,"", "gridDelays"    , mx::argType::Required,  "temporal", "gridDelays",     false, "real vector", "The loop delays [s] at which to analyze a grid, all from one read of each PSD.  Results for each are in .../delay_<deltaTau>.  Default is deltaTau.");
    config.add("intTimes"      ,"", "intTimes",    mx::argType::Required,  "temporal", "intTimes",     false, "int vector", "Integration times in units of minTauWFS");
    
+   //Surrogate
+   config.add("surrogateFile"  ,"", "surrogateFile"  , mx::argType::Required, "surrogate", "surrogateFile",  false, "string", "The surrogate table written by mode surrogate and read by mode surrogateQuery.");
+   config.add("surR0"          ,"", "surR0"          , mx::argType::Required, "surrogate", "surR0",          false, "real vector", "min,max,N of the r_0 axis [m], at lam_0.  Default is the configured r_0.");
+   config.add("surWind"        ,"", "surWind"        , mx::argType::Required, "surrogate", "surWind",        false, "real vector", "min,max,N of the mean wind speed axis [m/s].  Default is the configured v_wind.");
+   config.add("surZeta"        ,"", "surZeta"        , mx::argType::Required, "surrogate", "surZeta",        false, "real vector", "min,max,N of the zenith distance axis [rad].  Default is the configured zeta.");
+   config.add("surLam"         ,"", "surLam"         , mx::argType::Required, "surrogate", "surLam",         false, "real vector", "min,max,N of the science wavelength axis [m].  Default is the configured lam_sci.");
+   config.add("surMag"         ,"", "surMag"         , mx::argType::Required, "surrogate", "surMag",         false, "real vector", "min,max,N of the star magnitude axis.  Default is the configured starMag.");
+   config.add("surrogateCheck" ,"", "surrogateCheck" , mx::argType::Required, "surrogate", "surrogateCheck", false, "int", "Number of random held-out points at which the surrogate is compared to exact evaluations.  Default is 200.");
+   
 }
 
 template<typename realT>
@@ -224,10 +894,83 @@ void mxAOSystem_app<realT>::loadConfig()
       
    config(mode, "mode");
    
+   config(dryRun, "dryRun");
+   
+   config(gradParams, "gradParams");
+   config(gradStep, "gradStep");
+   
+   config(mcParams, "mcParams");
+   config(mcSamples, "mcSamples");
+   config(mcSeed, "mcSeed");
+   config(mcQuantiles, "mcQuantiles");
+   
+   config(tauWFSCandidates, "tauWFSList");
+   if(config.isSet("tauWFSRange"))
+   {
+      std::vector<realT> range = config.get<std::vector<realT>>("tauWFSRange");
+      if(range.size() != 3 || range[0] <= 0 || range[1] < range[0] || range[2] < 1)
+      {
+         std::cerr << "tauWFSRange must be min,max,N with 0 < min <= max and N >= 1.\n";
+         configErr = true;
+      }
+      else
+      {
+         //Logarithmically spaced, since the optimum scales with the flux
+         int N = range[2];
+         for(int i=0; i < N; ++i)
+         {
+            tauWFSCandidates.push_back( range[0]*pow(range[1]/range[0], (N > 1) ? ((realT) i)/(N-1) : 0) );
+         }
+      }
+   }
+   
+   config(threads, "threads");
+   setThreadBudget(threads);
+   
+   if(config.isSet("maxMemory"))
+   {
+      size_t maxMem;
+      if(parseMemorySize(maxMem, config.get<std::string>("maxMemory")) < 0) configErr = true;
+      else budget.max(maxMem);
+   }
+   
+   config(numaPin, "numaPin");
+   if(numaPin)
+   {
+      if(numa.load() < 0) numaPin = false;
+   }
+   
+   config(writeQueue, "writeQueue");
+   if(writeQueue < 0) writeQueue = 0;
+   writer.maxQueue(writeQueue);
+   
+   config(fitsCompress, "compress");
+   config(fitsQuantize, "quantize");
+   
    config(wfeUnits, "wfeUnits");
    
    config(mnMap, "mnMap");
    
+   config(mapOversamp, "mapOversamp");
+   config(curveOversamp, "curveOversamp");
+   config(curveStats, "curveStats");
+   config(curveBinWidth, "curveBinWidth");
+   config(curvePercentiles, "curvePercentiles");
+   
+   config(mapRegion, "mapRegion");
+   config(regionIWA, "regionIWA");
+   config(regionOWA, "regionOWA");
+   config(regionAngle, "regionAngle");
+   config(regionWidth, "regionWidth");
+   config(regionMask, "regionMask");
+   
+   config(mapProgressive, "mapProgressive");
+   config(progStride, "progStride");
+   config(progTol, "progTol");
+   
+   config(mapTile, "mapTile");
+   config(psfRadius, "psfRadius");
+   
    /**********************************************************/
    /* Models                                                 */
    /**********************************************************/
@@ -247,6 +990,21 @@ void mxAOSystem_app<realT>::loadConfig()
       }
    }
    
+   //A snapshot replaces a model
+   std::string snapshot;
+   config(snapshot, "snapshot");
+   
+   if(snapshot != "")
+   {
+      if(loadSnapshot(snapshot) < 0)
+      {
+         configErr = true;
+         return;
+      }
+   }
+   
+   config(snapshotOut, "snapshotOut");
+   
    /**********************************************************/
    /* Atmosphere                                             */
    /**********************************************************/
@@ -357,6 +1115,8 @@ void mxAOSystem_app<realT>::loadConfig()
          std::cerr << "Unkown WFS type\n";
          exit(-1);
       }
+      
+      wfsType = wfs;
    }
    
    //diameter
@@ -456,6 +1216,41 @@ void mxAOSystem_app<realT>::loadConfig()
       starMags = config.get<std::vector<realT>>("starMags");
    }
    
+   /**********************************************************/
+   /* Bandpass                                               */
+   /**********************************************************/
+   //After lam_sci, since the top-hat is centered on it.
+   config(bandWidth, "bandWidth");
+   config(bandTable, "bandTable");
+   config(bandTol, "bandTol");
+   config(bandMaxDepth, "bandMaxDepth");
+   
+   if(bandTable != "")
+   {
+      if(band.load(bandTable) < 0)
+      {
+         configErr = true;
+         return;
+      }
+   }
+   else if(bandWidth > 0)
+   {
+      if(bandWidth >= 2*aosys.lam_sci())
+      {
+         std::cerr << "bandWidth must be less than 2*lam_sci\n";
+         configErr = true;
+         return;
+      }
+      
+      band.tophat(aosys.lam_sci(), bandWidth);
+   }
+   
+   if(mode == "ErrorBudget" && band.active() && gradParams.size() > 0)
+   {
+      std::cerr << "gradParams is not supported for ErrorBudget with a bandpass.  Unset bandWidth and bandTable, or gradParams.\n";
+      configErr = true;
+   }
+   
    /**********************************************************/
    /* Temporal PSDs                                          */
    /**********************************************************/
@@ -466,8 +1261,30 @@ void mxAOSystem_app<realT>::loadConfig()
    
    config.get(gridDir, "gridDir");
    config.get(subDir, "subDir");
+   config.get(gridFormat.format, "gridFormat");
+   config.get(gridFormat.precision, "gridPrecision");
+   config.get(gridNormalize, "gridNormalize");
+   config.get(gridR0, "gridR0");
+   config.get(gridWindScale, "gridWindScale");
+   config.get(gridLayers, "gridLayers");
+   config.get(gridCn2, "gridCn2");
+   config.get(gridCn2File, "gridCn2File");
+   gridFormat.compress = fitsCompress;
+   gridFormat.quantize = fitsQuantize;
    config.get(lpNc, "lpNc");
+   config.get(gridDelays, "gridDelays");
    config.get(intTimes, "intTimes");
+   
+   /**********************************************************/
+   /* Surrogate                                              */
+   /**********************************************************/
+   config.get(surrogateFile, "surrogateFile");
+   config.get(surR0, "surR0");
+   config.get(surWind, "surWind");
+   config.get(surZeta, "surZeta");
+   config.get(surLam, "surLam");
+   config.get(surMag, "surMag");
+   config.get(surrogateCheck, "surrogateCheck");
 
 }
 
@@ -480,6 +1297,19 @@ int mxAOSystem_app<realT>::execute()
 {
    int rv;
    
+   if(configErr)
+   {
+      std::cerr << "Invalid configuration, see the errors above.\n";
+      return -1;
+   }
+   
+   sys = aosysSnapshot<aosysT>(aosys);
+   
+   if(dryRun)
+   {
+      return dryRunEstimate();
+   }
+   
    if(mode == "C0Raw")
    {
       rv = C0Raw();
@@ -532,10 +1362,18 @@ int mxAOSystem_app<realT>::execute()
    {
       rv = CAllRaw();
    }
+   else if (mode == "CAllMap")
+   {
+      rv = CAllMap();
+   }
    else if (mode == "ErrorBudget")
    {
       rv = ErrorBudget();
    }
+   else if (mode == "ErrorBudgetMC")
+   {
+      rv = ErrorBudgetMC();
+   }
    else if (mode == "Strehl")
    {
       rv = Strehl();
@@ -552,6 +1390,14 @@ int mxAOSystem_app<realT>::execute()
    {
       rv = temporalPSDGridAnalyze();
    }
+   else if (mode == "surrogate")
+   {
+      rv = surrogate();
+   }
+   else if (mode == "surrogateQuery")
+   {
+      rv = surrogateQuery();
+   }
    else
    {
       std::cerr << "Unknown mode: " << mode << "\n";
@@ -560,6 +1406,14 @@ int mxAOSystem_app<realT>::execute()
    
    
    
+   //Complete any pending output
+   if(writer.finish() < 0) rv = -1;
+   
+   if(snapshotOut != "" && rv == 0)
+   {
+      if(saveSnapshot(snapshotOut) < 0) rv = -1;
+   }
+   
    if(dumpSetup && rv == 0)
    {
       std::ofstream fout;
@@ -574,343 +1428,2834 @@ int mxAOSystem_app<realT>::execute()
 }
 
 template<typename realT>
-int mxAOSystem_app<realT>::C_MapCon( const std::string & mapFile,
-                                     imageT & map
-                                   )
+int mxAOSystem_app<realT>::writeFits( const std::string & fileName,
+                                      imageT & im
+                                    )
 {
-   imageT im, psf;
-   
-   psf.resize(map.rows(),map.cols());
-   for(int i=0;i<psf.rows();++i)
-   {
-      for(int j=0;j<psf.cols();++j)
-      {
-         psf(i,j) = mx::math::func::airyPattern(sqrt( pow( i-floor(.5*psf.rows()),2) + pow(j-floor(.5*psf.cols()),2)));
-      }
-   }
-   
-   mx::AO::analysis::varmapToImage(im, map, psf);
-   
-   for(int i=0; i< mnMap; ++i)
+   if(fitsCompress == "none")
    {
-      std::cout << i << " " << im( mnMap+1, mnMap+1 + i) << "\n";
+      mx::improc::fitsFile<realT> ff;
+      return ff.write(fileName, im);
    }
    
-   mx::improc::fitsFile<realT> ff;
-   ff.write(mapFile, im);
-
+   fitsTileFile<realT> ff;
+   if(ff.compression(fitsCompress, fitsQuantize) < 0) return -1;
    
+   return ff.writeImage(fileName, im);
 }
 
 template<typename realT>
-int mxAOSystem_app<realT>::C0Raw()
+std::string mxAOSystem_app<realT>::previewName( const std::string & mapFile )
 {
-   for(int i=0;i< aosys.fit_mn_max(); ++i)
-   {
-      std::cout << i << " " << aosys.C0(i,0, false) << "\n";
-   }
+   size_t pos = mapFile.rfind(".fits");
+   
+   if(pos == std::string::npos) return mapFile + "_preview";
+   
+   return mapFile.substr(0, pos) + "_preview" + mapFile.substr(pos);
 }
 
 template<typename realT>
-int mxAOSystem_app<realT>::C0Map()
+int mxAOSystem_app<realT>::mapSize()
 {
-   imageT map;
-   
-   map.resize( mnMap*2+1, mnMap*2 + 1);
-   
-   aosys.C0Map(map);
-   
-   C_MapCon("C0Map.fits", map);
-   
+   return 2*round(mnMap*mapOversamp) + 1;
 }
 
 template<typename realT>
-int mxAOSystem_app<realT>::C1Raw()
+void mxAOSystem_app<realT>::reportScaling( const std::string & func,
+                                           size_t nModes,
+                                           int nThreads,
+                                           std::chrono::steady_clock::time_point t0
+                                         )
 {
-   for(int i=0;i< aosys.fit_mn_max(); ++i)
-   {
-      std::cout << i << " " << aosys.C1(i,0, false) << "\n";
-   }
+   double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+   
+   std::cerr << func << ": " << nModes << " modes in " << wall << " s on " << nThreads << " threads";
+   if(numaPin) std::cerr << " pinned over " << numa.nNodes() << " NUMA nodes";
+   std::cerr << ", " << nModes/wall << " modes/s, " << nModes/wall/nThreads << " modes/s/thread\n";
 }
 
 template<typename realT>
-int mxAOSystem_app<realT>::C1Map()
+int mxAOSystem_app<realT>::dryRunEstimate()
 {
-   imageT map;
+   typedef std::chrono::steady_clock clockT;
    
-   map.resize( mnMap*2+1, mnMap*2 + 1);
+   int nThreads = omp_get_max_threads();
    
-   aosys.C1Map(map);
+   size_t nEval = 0; //The number of expensive evaluations
+   std::string evalName;
+   double tEval = 0; //Time per evaluation [s]
+   double peakMem = 0; //[bytes]
+   double disk = 0; //[bytes]
+   
+   if(mode.find("Map") != std::string::npos)
+   {
+      size_t N = mapSize();
+      
+      size_t nPix = N*N;
+      if(mapRegion != "full" && mapRegion != "mask")
+      {
+         std::vector<size_t> pix;
+         mapRegionPixels(pix, N, N);
+         nPix = pix.size();
+      }
+      
+      //The C functions evaluated by this mode
+      std::vector<CFuncT> Cfuncs;
+      if(mode == "C0Map") Cfuncs = { &aosysT::C0 };
+      else if(mode == "C1Map") Cfuncs = { &aosysT::C1 };
+      else if(mode == "C2Map") Cfuncs = { &aosysT::C2 };
+      else if(mode == "C4Map") Cfuncs = { &aosysT::C4 };
+      else if(mode == "C6Map") Cfuncs = { &aosysT::C6 };
+      else if(mode == "C7Map") Cfuncs = { &aosysT::C7 };
+      else if(mode == "CAllMap") Cfuncs = { &aosysT::C0, &aosysT::C1, &aosysT::C2, &aosysT::C4, &aosysT::C6, &aosysT::C7 };
+      else
+      {
+         std::cout << "dry-run: " << mode << " is not a map mode.\n";
+         return 0;
+      }
+      
+      size_t nTerms = Cfuncs.size();
+      
+      size_t L = mapTile + 2*ceil(psfRadius*mapOversamp);
+      if(mapTile > 0)
+      {
+         //Each tile is evaluated over its halo too.  Restricted regions are scaled by the fraction of pixels they cover.
+         size_t nT = (N + mapTile - 1)/mapTile;
+         nEval = nTerms * (size_t) ( ((double) nT*nT*L*L)*nPix/(N*N) );
+      }
+      else nEval = nTerms * nPix;
+      if(band.active()) nEval *= 5; //At least one Simpson step per bandpass interval
+      evalName = "C* evaluations";
+      
+      //Calibrate on points across the map, averaged over the mode's C functions
+      auto t0 = clockT::now();
+      int nCal = 64;
+      realT x = 0;
+      for(size_t f=0; f < nTerms; ++f)
+      {
+         for(int k=0; k < nCal; ++k) x += (aosys.*Cfuncs[f])( (k % 16) - 8 + 0.5, (k / 16), false);
+      }
+      tEval = std::chrono::duration<double>(clockT::now() - t0).count()/(nCal*nTerms);
+      
+      if(mapTile > 0)
+      {
+         peakMem = 2*L*L*2*sizeof(realT) + (writeQueue+1)*mapTile*mapTile*sizeof(realT);
+      }
+      else
+      {
+         //map, psf, and image, plus the kept images for CAllMap
+         peakMem = (3 + nTerms)*N*N*sizeof(realT);
+      }
+      
+      disk = nTerms * N*N*sizeof(realT);
+      if(mapProgressive) disk *= 2;
+   }
+   else if(mode == "temporalPSDGrid")
+   {
+      if(aosys.minTauWFS() <= 0 || dfreq <= 0 || aosys.fit_mn_max() <= 0)
+      {
+         std::cerr << "dry-run: You must set minTauWFS, dfreq, and fit_mn_max to be > 0.\n";
+         return -1;
+      }
+      
+      int mnMax = aosys.fit_mn_max();
+      realT fs = 1.0/aosys.minTauWFS();
+      
+      size_t nFreq = fs/dfreq;
+      if(nFreq*dfreq < fs) ++nFreq;
+      
+      size_t nModes = ((2*mnMax+1)*(2*mnMax+1) - 1)/2;
+      size_t nLayers = aosys.atm.n_layers();
+      
+      nEval = nModes * nFreq * nLayers;
+      evalName = "layer PSD integrals";
+      
+      //Calibrate on a few frequencies of a mid-band mode
+      std::vector<realT> freq, psd;
+      size_t nCal = std::min<size_t>(nFreq, 16);
+      mx::math::vectorScale(freq, nCal, fs/nCal, dfreq);
+      psd.resize(freq.size());
+      
+      mx::AO::analysis::fourierTemporalPSD<realT, aosysT> ftPSD;
+      ftPSD._aosys = &aosys;
+      
+      auto t0 = clockT::now();
+      ftPSD.multiLayerPSD(psd, freq, 0.5*mnMax, 0.25*mnMax, 1, 0);
+      tEval = std::chrono::duration<double>(clockT::now() - t0).count()/(nCal*std::max<size_t>(nLayers,1));
+      
+      size_t bytes = (gridFormat.precision == "float") ? sizeof(float) : sizeof(realT);
+      
+      peakMem = (nThreads + writeQueue + 1)*nFreq*sizeof(realT);
+      disk = nModes*(nFreq*bytes + 16) + nFreq*sizeof(realT);
+   }
+   else if(mode == "temporalPSDGridAnalyze")
+   {
+      std::vector<realT> freq;
+      if(mx::ioutils::readBinVector(freq, gridDir + "/freq.binv") < 0 || freq.size() < 2)
+      {
+         std::cerr << "dry-run: error reading " << gridDir << "/freq.binv\n";
+         return -1;
+      }
+      
+      int mnMax = aosys.fit_mn_max();
+      int mnCon = aosys.D()/aosys.d_min()/2;
+      int mc = std::min(mnMax, mnCon);
+      
+      size_t nModes = (2*mc+1)*(2*mc+1)/2;
+      size_t nMags = std::max<size_t>(starMags.size(), 1);
+      
+      //Each r_0 at each wind speed for each Cn^2 profile, counted as temporalPSDGridAnalyze builds them
+      size_t nProfiles = (gridCn2.size() > 0) ? 1 : 0;
+      if(gridCn2File != "")
+      {
+         std::ifstream fin(gridCn2File);
+         std::string line;
+         while(std::getline(fin, line))
+         {
+            if(line.find('#') != std::string::npos) line.erase(line.find('#'));
+            if(line.find_first_of("0123456789") != std::string::npos) ++nProfiles;
+         }
+      }
+      size_t nConds = std::max<size_t>(gridR0.size(), 1) * std::max<size_t>(gridWindScale.size(), 1) * std::max<size_t>(nProfiles, 1);
+      
+      size_t nDelays = std::max<size_t>(gridDelays.size(), 1);
+      
+      size_t nOrders = 0;
+      for(size_t i=0; i < lpNc.size(); ++i) if(lpNc[i] > 1) ++nOrders;
+      
+      //The simple integrator's optimization and each order's regularizeCoefficients sweep, at every delay
+      nEval = nConds * nMags * nModes * intTimes.size() * nDelays * (1 + nOrders);
+      evalName = "gain optimizations";
+      
+      //Calibrate on a synthetic -11/3 power law
+      std::vector<realT> psd(freq.size());
+      for(size_t i=0; i < freq.size(); ++i) psd[i] = pow(freq[i], -11./3);
+      
+      aosysT lsys = sys.get();
+      std::vector<modeResult> res;
+      std::vector<int> one = {intTimes.size() > 0 ? intTimes[0] : 1};
+      std::vector<realT> delays = gridDelays;
+      if(delays.size() == 0) delays = { aosys.deltaTau() };
+      
+      //One integration time runs every optimization of a mode once, so the time is averaged over them
+      auto t0 = clockT::now();
+      analyzeModePSD(res, lsys, freq, psd, 1, 1, lpNc, delays, one);
+      tEval = std::chrono::duration<double>(clockT::now() - t0).count()/(nDelays*(1 + nOrders));
+      
+      peakMem = (2*nThreads + 1)*freq.size()*sizeof(realT) + nConds*nMags*nModes*nDelays*(sizeof(modeResult) + 3*nOrders*sizeof(realT));
+      
+      //modes_<mag>.dat and maps_<mag>.fits, for each condition and delay
+      disk = nConds*nDelays*(nMags*nModes*100 + nMags*(2*mc+1)*(2*mc+1)*(3 + 4*nOrders)*sizeof(realT));
+   }
+   else if(mode == "surrogate")
+   {
+      perfSurrogate<realT> sur;
+      if(surrogateSetup(sur) < 0) return -1;
+      
+      nEval = sur.nPoints() + std::max(surrogateCheck, 0);
+      evalName = "error budgets";
+      
+      Eigen::Array<realT, -1, -1> terms;
+      std::vector<realT> bestTau;
+      std::vector<realT> mag = { aosys.starMag() };
+      
+      auto t0 = clockT::now();
+      errorBudgetBatch(terms, bestTau, sys, mag, tauWFSCandidates);
+      tEval = std::chrono::duration<double>(clockT::now() - t0).count();
+      
+      peakMem = sur.nPoints()*sur.nOut()*sizeof(realT);
+      disk = peakMem;
+   }
+   else
+   {
+      std::cout << "dry-run: " << mode << " is not expensive, estimates are only made for the map, grid, and surrogate modes.\n";
+      return 0;
+   }
    
-   C_MapCon("C1Map.fits", map);
+   double wall = nEval*tEval/nThreads;
    
-}
-
-template<typename realT>
-int mxAOSystem_app<realT>::C2Raw()
-{
-   for(int i=0;i< aosys.fit_mn_max(); ++i)
+   std::cout << "dry-run: " << mode << "\n";
+   std::cout << "  " << evalName << ":   " << nEval << "\n";
+   std::cout << "  calibration:         " << tEval << " s per evaluation\n";
+   std::cout << "  est. wall time:      " << wall << " s (" << wall/3600. << " hr) on " << nThreads << " threads\n";
+   std::cout << "  est. peak memory:    " << peakMem/1048576. << " MB\n";
+   std::cout << "  est. disk output:    " << disk/1048576. << " MB\n";
+   if(budget.max() > 0)
    {
-      std::cout << i << " " << aosys.C2(i,0, false) << "\n";
+      std::cout << "  memory budget:       " << budget.max()/1048576. << " MB, ";
+      std::cout << (peakMem <= budget.max() ? "sufficient" : (mode == "temporalPSDGrid" ? "exceeded, PSDs will wait for writes" : "exceeded, the run may be refused")) << "\n";
    }
+   
+   return 0;
 }
 
 template<typename realT>
-int mxAOSystem_app<realT>::C2Map()
+int mxAOSystem_app<realT>::C_Convolve( imageT & im,
+                                       imageT & map
+                                     )
 {
-   imageT map;
+   imageT psf;
    
-   map.resize( mnMap*2+1, mnMap*2 + 1);
+   psf.resize(map.rows(),map.cols());
+   for(int i=0;i<psf.rows();++i)
+   {
+      for(int j=0;j<psf.cols();++j)
+      {
+         psf(i,j) = mx::math::func::airyPattern(sqrt( pow( i-floor(.5*psf.rows()),2) + pow(j-floor(.5*psf.cols()),2))/mapOversamp);
+      }
+   }
    
-   aosys.C2Map(map);
+   mx::AO::analysis::varmapToImage(im, map, psf);
    
-   C_MapCon("C2Map.fits", map);
+   //Each lambda/D x lambda/D cell of the map covers mapOversamp^2 pixels
+   if(mapOversamp != 1) im /= mapOversamp*mapOversamp;
    
+   return 0;
 }
 
 template<typename realT>
-int mxAOSystem_app<realT>::C4Raw()
+int mxAOSystem_app<realT>::C_MapCon( const std::string & mapFile,
+                                     imageT & map
+                                   )
 {
-   for(int i=0;i< aosys.fit_mn_max(); ++i)
-   {
-      std::cout << i << " " << aosys.C4(i,0, false) << "\n";
-   }
+   std::vector<imageT> ims(1);
+   
+   C_Convolve(ims[0], map);
+   
+   int rv = writeCurves(std::cout, {""}, ims);
+   
+   writer.push( [this, mapFile, im = std::move(ims[0])]() mutable
+                {
+                   return writeFits(mapFile, im);
+                });
+
+   return rv;
 }
 
 template<typename realT>
-int mxAOSystem_app<realT>::C4Map()
+int mxAOSystem_app<realT>::mapRegionPixels( std::vector<size_t> & pix,
+                                            int rows,
+                                            int cols
+                                          )
 {
-   imageT map;
+   pix.clear();
    
-   map.resize( mnMap*2+1, mnMap*2 + 1);
+   if(mapRegion == "mask")
+   {
+      if(regionMask == "")
+      {
+         std::cerr << "mapRegionPixels: You must set regionMask for mapRegion = mask.\n";
+         return -1;
+      }
+      
+      imageT mask;
+      mx::improc::fitsFile<realT> ff;
+      ff.read(mask, regionMask);
+      
+      if(mask.rows() != rows || mask.cols() != cols)
+      {
+         std::cerr << "mapRegionPixels: regionMask is " << mask.rows() << " x " << mask.cols() << ", but the map is " << rows << " x " << cols << ".\n";
+         return -1;
+      }
+      
+      for(size_t k=0; k < (size_t) mask.size(); ++k)
+      {
+         if(mask.data()[k] != 0) pix.push_back(k);
+      }
+      
+      return 0;
+   }
    
-   aosys.C4Map(map);
+   if(mapRegion != "annulus" && mapRegion != "wedge")
+   {
+      std::cerr << "mapRegionPixels: Unknown mapRegion: " << mapRegion << "\n";
+      return -1;
+   }
    
-   C_MapCon("C4Map.fits", map);
+   realT mc = 0.5*(rows-1);
+   realT nc = 0.5*(cols-1);
    
-}
-
-template<typename realT>
-int mxAOSystem_app<realT>::C6Raw()
-{
-   for(int i=0;i< aosys.fit_mn_max(); ++i)
+   for(int j=0; j < cols; ++j)
    {
-      std::cout << i << " " << aosys.C6(i,0, false) << "\n";
+      for(int i=0; i < rows; ++i)
+      {
+         if(inGeomRegion( (i - mc)/mapOversamp, (j - nc)/mapOversamp)) pix.push_back( j*rows + i);
+      }
    }
+   
+   return 0;
 }
 
 template<typename realT>
-int mxAOSystem_app<realT>::C6Map()
+bool mxAOSystem_app<realT>::inGeomRegion( realT m,
+                                          realT n
+                                        )
 {
-   imageT map;
+   if(mapRegion == "full") return true;
    
-   map.resize( mnMap*2+1, mnMap*2 + 1);
+   realT owa = regionOWA;
+   if(owa <= 0) owa = 0.5*aosys.D()/aosys.d_min();
    
-   aosys.C6Map(map);
+   realT r = sqrt(m*m + n*n);
    
-   C_MapCon("C6Map.fits", map);
+   if(r < regionIWA || r > owa) return false;
    
-}
-
-
-template<typename realT>
-int mxAOSystem_app<realT>::C7Raw()
-{
-   for(int i=0;i< aosys.fit_mn_max(); ++i)
+   if(mapRegion == "wedge")
    {
-      std::cout << i << " " << aosys.C7(i,0, false) << "\n";
+      realT dang = fabs( remainder( atan2(n, m) - regionAngle, 2*pi<realT>()));
+      if(dang > 0.5*regionWidth) return false;
    }
+   
+   return true;
 }
 
 template<typename realT>
-int mxAOSystem_app<realT>::C7Map()
+int mxAOSystem_app<realT>::C_EvalMap( imageT & map,
+                                      CMapFuncT mapFunc,
+                                      CFuncT Cfunc,
+                                      const std::string & previewFile
+                                    )
 {
-   imageT map;
+   std::vector<size_t> pix;
    
-   map.resize( mnMap*2+1, mnMap*2 + 1);
+   if(mapRegion == "full")
+   {
+      //Fast path: the integer lattice is handled by aoSystem
+      if(mapOversamp == 1 && !mapProgressive && !band.active())
+      {
+         (aosys.*mapFunc)(map);
+         return 0;
+      }
+      
+      pix.resize(map.size());
+      for(size_t k=0; k < pix.size(); ++k) pix[k] = k;
+   }
+   else
+   {
+      if( mapRegionPixels(pix, map.rows(), map.cols()) < 0) return -1;
+   }
    
-   aosys.C7Map(map);
+   if(band.active())
+   {
+      if(mapProgressive)
+      {
+         std::cerr << "C_EvalMap: mapProgressive can not be used with a bandpass.\n";
+         return -1;
+      }
+      
+      return C_EvalBand(map, Cfunc, pix);
+   }
    
-   C_MapCon("C7Map.fits", map);
+   if(mapProgressive) return C_EvalProgressive(map, Cfunc, pix, previewFile);
    
-}
-
-template<typename realT>
-int mxAOSystem_app<realT>::CAllRaw()
-{
-   for(int i=0;i< aosys.fit_mn_max(); ++i)
+   realT mc = 0.5*(map.rows()-1);
+   realT nc = 0.5*(map.cols()-1);
+   
+   map.setZero();
+   
+   for(size_t k=0; k < pix.size(); ++k)
    {
-      std::cout << i << " " << aosys.C0(i,0, false) << " " << aosys.C1(i,0, false) << " " << aosys.C2(i,0, false) << " " << aosys.C4(i,0, false);
-      std::cout << " " << aosys.C6(i,0, false) << " " << aosys.C7(i,0, false) << "\n";
+      int i = pix[k] % map.rows();
+      int j = pix[k] / map.rows();
+      
+      map(i,j) = (aosys.*Cfunc)( (i - mc)/mapOversamp, (j - nc)/mapOversamp, false);
    }
+   
+   return 0;
 }
 
-
 template<typename realT>
-int mxAOSystem_app<realT>::ErrorBudget()
+int mxAOSystem_app<realT>::C_EvalProgressive( imageT & map,
+                                              CFuncT Cfunc,
+                                              const std::vector<size_t> & pix,
+                                              const std::string & previewFile
+                                            )
 {
-   realT units = 1;
+   if(progStride < 1)
+   {
+      std::cerr << "C_EvalProgressive: You must set progStride to be >= 1.\n";
+      return -1;
+   }
    
-   if(wfeUnits == "nm")
+   if(progTol < 0)
    {
-      std::cerr << aosys.lam_sci() << "\n";
-      units = aosys.lam_sci() / (2.0*pi<realT>()) / 1e-9;
+      std::cerr << "C_EvalProgressive: You must set progTol to be >= 0.\n";
+      return -1;
    }
    
-   if(starMags.size() == 0)
+   int rows = map.rows();
+   int cols = map.cols();
+   
+   realT mc = 0.5*(rows-1);
+   realT nc = 0.5*(cols-1);
+   
+   //Pixels outside the region are known to be 0.
+   Eigen::Array<char,-1,-1> known(rows, cols);
+   known.setOnes();
+   for(size_t k=0; k < pix.size(); ++k) known.data()[pix[k]] = 0;
+   
+   map.setZero();
+   
+   size_t nComputed = 0;
+   
+   auto evalPix = [&](int i, int j)
+   {
+      if(known(i,j)) return map(i,j);
+      
+      map(i,j) = (aosys.*Cfunc)( (i - mc)/mapOversamp, (j - nc)/mapOversamp, false);
+      known(i,j) = 1;
+      ++nComputed;
+      
+      return map(i,j);
+   };
+   
+   auto interp = [&](int i0, int j0, int i1, int j1, int i, int j)
+   {
+      realT x = (i1 > i0) ? ((realT) (i - i0))/(i1-i0) : 0;
+      realT y = (j1 > j0) ? ((realT) (j - j0))/(j1-j0) : 0;
+      
+      return (1-x)*(1-y)*map(i0,j0) + x*(1-y)*map(i1,j0) + (1-x)*y*map(i0,j1) + x*y*map(i1,j1);
+   };
+   
+   //The coarse lattice, always including the last row and column
+   std::vector<int> is, js;
+   for(int i=0; i < rows-1; i += progStride) is.push_back(i);
+   is.push_back(rows-1);
+   for(int j=0; j < cols-1; j += progStride) js.push_back(j);
+   js.push_back(cols-1);
+   
+   for(size_t b=0; b < js.size(); ++b)
    {
-      std::cout << "Measurement: " << sqrt(aosys.measurementError())*units << "\n";
-      std::cout << "Time-delay:  " << sqrt(aosys.timeDelayError())*units << "\n";
-      std::cout << "Fitting:     " << sqrt(aosys.fittingError())*units << "\n";
-      std::cout << "NCP error:   " << sqrt(aosys.ncpError())*units << "\n";
-      std::cout << "Strehl:      " << aosys.strehl() << "\n";
+      for(size_t a=0; a < is.size(); ++a) evalPix(is[a], js[b]);
    }
-   else
+   
+   //Preview: bilinear interpolation of the lattice
+   if(previewFile != "")
    {
-      std::cout << "#mag     Measurement     Time-delay      Fitting    Chr-Scint-OPD      Chr-Index   Disp-Ansio-OPD  NCP-error         Strehl\n";
+      imageT preview = map;
       
-      for(int i=0; i< starMags.size(); ++i)
+      for(size_t b=0; b < js.size()-1; ++b)
       {
-         aosys.starMag(starMags[i]);
-         std::cout << starMags[i] << "\t    ";
-         std::cout << sqrt(aosys.measurementError())*units << "\t   ";
-         std::cout << sqrt(aosys.timeDelayError())*units << "\t ";
-         std::cout << sqrt(aosys.fittingError())*units << "\t ";
-         std::cout << sqrt(aosys.chromScintOPDError())*units << "\t    ";
-         std::cout << sqrt(aosys.chromIndexError())*units << "\t\t    ";
-         std::cout << sqrt(aosys.dispAnisoOPDError())*units << "\t    ";
-         std::cout << sqrt(aosys.ncpError())*units << "\t\t";
-         std::cout << aosys.strehl() << "\n";
+         for(size_t a=0; a < is.size()-1; ++a)
+         {
+            for(int j = js[b]; j <= js[b+1]; ++j)
+            {
+               for(int i = is[a]; i <= is[a+1]; ++i)
+               {
+                  if(!known(i,j)) preview(i,j) = interp(is[a], js[b], is[a+1], js[b+1], i, j);
+               }
+            }
+         }
       }
+      
+      writeFits(previewFile, preview);
+      
+      std::cerr << "C_EvalProgressive: wrote preview " << previewFile << " from " << nComputed << " pixels.\n";
    }
+   
+   //Refinement
+   std::vector<std::array<int,4>> cells;
+   for(size_t b=0; b < js.size()-1; ++b)
+   {
+      for(size_t a=0; a < is.size()-1; ++a) cells.push_back({is[a], js[b], is[a+1], js[b+1]});
+   }
+   
+   while(cells.size() > 0)
+   {
+      std::array<int,4> c = cells.back();
+      cells.pop_back();
+      
+      int i0 = c[0], j0 = c[1], i1 = c[2], j1 = c[3];
+      
+      if(i1 - i0 <= 1 && j1 - j0 <= 1) continue;
+      
+      int mi = (i0+i1)/2;
+      int mj = (j0+j1)/2;
+      
+      std::array<std::array<int,2>,5> tests = {{ {mi,mj}, {mi,j0}, {mi,j1}, {i0,mj}, {i1,mj} }};
+      
+      bool converged = true;
+      for(size_t t=0; t < tests.size(); ++t)
+      {
+         int i = tests[t][0];
+         int j = tests[t][1];
+         
+         realT ip = interp(i0, j0, i1, j1, i, j);
+         realT ex = evalPix(i, j);
+         
+         if( fabs(ex - ip) > progTol*std::max(fabs(ex), fabs(ip)) ) converged = false;
+      }
+      
+      if(converged)
+      {
+         for(int j = j0; j <= j1; ++j)
+         {
+            for(int i = i0; i <= i1; ++i)
+            {
+               if(!known(i,j)) map(i,j) = interp(i0, j0, i1, j1, i, j);
+            }
+         }
+         continue;
+      }
       
+      std::vector<int> si = {i0}, sj = {j0};
+      if(mi > i0) si.push_back(mi);
+      si.push_back(i1);
+      if(mj > j0) sj.push_back(mj);
+      sj.push_back(j1);
       
+      for(size_t b=0; b < sj.size()-1; ++b)
+      {
+         for(size_t a=0; a < si.size()-1; ++a) cells.push_back({si[a], sj[b], si[a+1], sj[b+1]});
+      }
+   }
+   
+   std::cerr << "C_EvalProgressive: computed " << nComputed << " of " << pix.size() << " pixels.\n";
+   
    return 0;
 }
 
 template<typename realT>
-int mxAOSystem_app<realT>::Strehl()
+int mxAOSystem_app<realT>::C_EvalBand( imageT & map,
+                                       CFuncT Cfunc,
+                                       const std::vector<size_t> & pix
+                                     )
 {
-   std::cout << aosys.strehl() << "\n";
+   int rows = map.rows();
+   int cols = map.cols();
    
-   return 0;
+   realT mc = 0.5*(rows-1);
+   realT nc = 0.5*(cols-1);
+   
+   realT lam0 = aosys.lam_sci();
+   
+   auto eval = [&](imageT & val, realT lam)
+   {
+      aosysT lsys = sys.get();
+      lsys.lam_sci(lam);
+      
+      realT sc = lam0/lam/mapOversamp;
+      
+      val.setZero(rows, cols);
+      for(size_t k=0; k < pix.size(); ++k)
+      {
+         int i = pix[k] % rows;
+         int j = pix[k] / rows;
+         
+         val(i,j) = (lsys.*Cfunc)( (i - mc)*sc, (j - nc)*sc, false);
+      }
+   };
+   
+   //Each wavelength held during the integration is a map
+   return bandIntegrate(map, band, eval, bandTol, bandMaxDepth, &budget, rows*cols*sizeof(realT));
 }
 
 template<typename realT>
-int mxAOSystem_app<realT>::temporalPSD()
+int mxAOSystem_app<realT>::C_MapTiled( const std::string & mapFile,
+                                       CFuncT Cfunc
+                                     )
 {
-   std::vector<realT> freq, psd;
-
-   mx::AO::analysis::fourierTemporalPSD<realT, aosysT> ftPSD;
-   ftPSD._aosys = &aosys;
+   typedef std::complex<realT> complexT;
+   typedef Eigen::Array<complexT, -1, -1> cimageT;
    
-   if(aosys.minTauWFS() <= 0)
+   if(mapProgressive)
    {
-      std::cerr << "temporalPSD: You must set minTauWFS to be > 0 to specify loop frequency.\n";
+      std::cerr << "C_MapTiled: mapProgressive can not be used with mapTile.\n";
       return -1;
    }
    
-   if(dfreq <= 0)
+   if(psfRadius <= 0)
    {
-      std::cerr << "temporalPSD: You must set dfreq to be > 0 to specify frequency sampling.\n";
+      std::cerr << "C_MapTiled: You must set psfRadius to be > 0.\n";
       return -1;
    }
    
-   realT fs = 1.0/aosys.minTauWFS();
+   if(band.active())
+   {
+      std::cerr << "C_MapTiled: a bandpass can not be used with mapTile.\n";
+      return -1;
+   }
    
-   mx::math::vectorScale(freq, 0.5*fs/dfreq, dfreq, dfreq);
-   psd.resize(freq.size());
+   if(mapRegion != "full" && mapRegion != "annulus" && mapRegion != "wedge" && mapRegion != "mask")
+   {
+      std::cerr << "C_MapTiled: Unknown mapRegion: " << mapRegion << "\n";
+      return -1;
+   }
    
-   ftPSD.multiLayerPSD( psd, freq, k_m, k_n, 1, kmax);
+   int N = mapSize();
+   int T = mapTile;
+   int h = ceil(psfRadius*mapOversamp);
+   int L = T + 2*h;
    
+   realT mc = 0.5*(N-1);
    
-   for(int i=0; i < freq.size(); ++i)
+   fitsTileFile<realT> maskFile;
+   if(mapRegion == "mask")
    {
-      std::cout << freq[i] << " " << psd[i] << "\n";
+      if(maskFile.open(regionMask) < 0) return -1;
+      
+      if(maskFile.rows() != N || maskFile.cols() != N)
+      {
+         std::cerr << "C_MapTiled: regionMask is " << maskFile.rows() << " x " << maskFile.cols() << ", but the map is " << N << " x " << N << ".\n";
+         return -1;
+      }
    }
    
-   return 0;
-}
-
-template<typename realT>
-int mxAOSystem_app<realT>::temporalPSDGrid()
-{
-   mx::AO::analysis::fourierTemporalPSD<realT, aosysT> ftPSD;
-   ftPSD._aosys = &aosys;
+   mx::fft::fftT<complexT, complexT, 2, 0> fft_fwd(L, L, MXFFT_FORWARD, true);
+   mx::fft::fftT<complexT, complexT, 2, 0> fft_back(L, L, MXFFT_BACKWARD, true);
    
-   if(gridDir == "")
+   //Transform of the truncated PSF, centered at 0 with wrap-around.
+   cimageT psfK(L, L);
+   psfK.setZero();
+   for(int dj = -h; dj <= h; ++dj)
    {
-      std::cerr << "temporalPSDGrid: You must set gridDir.\n";
-      return -1;
+      for(int di = -h; di <= h; ++di)
+      {
+         realT r = sqrt(di*di + dj*dj)/mapOversamp;
+         if(r > psfRadius) continue;
+         
+         psfK( (di + L) % L, (dj + L) % L) = mx::math::func::airyPattern(r);
+      }
    }
+   fft_fwd(psfK.data(), psfK.data());
    
-   if(aosys.fit_mn_max() <= 0)
+   //The FFTs are unnormalized, and each lambda/D x lambda/D cell covers mapOversamp^2 pixels
+   psfK /= ((realT) L*L) * mapOversamp*mapOversamp;
+   
+   fitsTileFile<realT> out;
+   if(out.compression(fitsCompress, fitsQuantize) < 0) return -1;
+   //Compression tiles on the map tiles, so each is compressed once when it is written
+   if(out.create(mapFile, N, N, 1, T, T) < 0) return -1;
+   
+   //Streaming azimuthal mean, or the row cut
+   if(curveStats && curveBinWidth <= 0)
    {
-      std::cerr << "temporalPSDGrid: You must set fit_mn_max to be > 0.\n";
+      std::cerr << "C_MapTiled: You must set curveBinWidth to be > 0.\n";
       return -1;
    }
+   realT dr = curveBinWidth*mapOversamp;
+   size_t nBins = curveStats ? floor(mc/dr + 0.5) + 1 : 0;
+   std::vector<realT> binSum(nBins, 0), binRad(nBins, 0);
+   std::vector<size_t> binN(nBins, 0);
+   
+   int rc = (N-1)/2 + 1;
+   std::vector<realT> row(N, 0);
+   
+   cimageT block(L, L);
+   imageT mask, tile;
+   
+   for(int j0 = 0; j0 < N; j0 += T)
+   {
+      for(int i0 = 0; i0 < N; i0 += T)
+      {
+         //Map over the tile and its halo, clipped to the image
+         int bi0 = std::max(0, i0 - h);
+         int bj0 = std::max(0, j0 - h);
+         int bi1 = std::min(N, i0 + T + h);
+         int bj1 = std::min(N, j0 + T + h);
+         
+         if(mapRegion == "mask")
+         {
+            mask.resize(bi1 - bi0, bj1 - bj0);
+            if(maskFile.readTile(mask, bi0, bj0) < 0)
+            {
+               writer.flush();
+               return -1;
+            }
+         }
+         
+         block.setZero();
+         for(int j = bj0; j < bj1; ++j)
+         {
+            for(int i = bi0; i < bi1; ++i)
+            {
+               realT m = (i - mc)/mapOversamp;
+               realT n = (j - mc)/mapOversamp;
+               
+               if(mapRegion == "mask")
+               {
+                  if(mask(i-bi0, j-bj0) == 0) continue;
+               }
+               else if(!inGeomRegion(m, n)) continue;
+               
+               block(i - i0 + h, j - j0 + h) = (aosys.*Cfunc)(m, n, false);
+            }
+         }
+         
+         fft_fwd(block.data(), block.data());
+         block *= psfK;
+         fft_back(block.data(), block.data());
+         
+         //Keep only the un-wrapped center
+         tile = block.block(h, h, std::min(T, N-i0), std::min(T, N-j0)).real();
+         
+         writer.push( [&out, tile, i0, j0]() mutable
+                      {
+                         return out.writeTile(tile, i0, j0);
+                      });
+         
+         if(!curveStats)
+         {
+            if(rc >= i0 && rc < i0 + tile.rows())
+            {
+               for(int j = 0; j < tile.cols(); ++j) row[j0 + j] = tile(rc - i0, j);
+            }
+            continue;
+         }
+         
+         for(int j = 0; j < tile.cols(); ++j)
+         {
+            for(int i = 0; i < tile.rows(); ++i)
+            {
+               realT r = sqrt( pow(i0 + i - mc, 2) + pow(j0 + j - mc, 2));
+               size_t b = floor(r/dr + 0.5);
+               if(b >= nBins) continue;
+               
+               binSum[b] += tile(i,j);
+               binRad[b] += r;
+               ++binN[b];
+            }
+         }
+      }
+   }
+   
+   //The pending tiles refer to out
+   writer.flush();
+   
+   if(out.close() < 0) return -1;
+   
+   if(!curveStats)
+   {
+      writeRowCut(std::cout, row);
+      return 0;
+   }
+   
+   std::cout << "#sep mean\n";
+   for(size_t b=0; b < nBins; ++b)
+   {
+      if(binN[b] == 0) continue;
+      std::cout << binRad[b]/binN[b]/mapOversamp << " " << binSum[b]/binN[b] << "\n";
+   }
    
+   return 0;
+}
 
-   if(dfreq <= 0)
+template<typename realT>
+int mxAOSystem_app<realT>::C_Map( const std::string & mapFile,
+                                  CMapFuncT mapFunc,
+                                  CFuncT Cfunc
+                                )
+{
+   if(mapOversamp <= 0)
    {
-      std::cerr << "temporalPSDGrid: You must set dfreq to be > 0 to specify frequency sampling.\n";
+      std::cerr << "C_Map: You must set mapOversamp to be > 0.\n";
       return -1;
    }
    
-   if(aosys.minTauWFS() <= 0)
+   if(mapTile > 0) return C_MapTiled(mapFile, Cfunc);
+   
+   //The map, the PSF, and the convolved image
+   if(!budget.fits(3*mapSize()*mapSize()*sizeof(realT)))
    {
-      std::cerr << "temporalPSDGrid: You must set minTauWFS to be > 0 to specify loop frequency.\n";
+      std::cerr << "C_Map: a " << mapSize() << "x" << mapSize() << " map does not fit in the memory budget.  Use mapTile.\n";
       return -1;
    }
+   memoryLease lease(budget, 3*mapSize()*mapSize()*sizeof(realT));
    
-   realT fs = 1.0/aosys.minTauWFS();
+   imageT map;
    
-   ftPSD.makePSDGrid( gridDir, aosys.fit_mn_max(), dfreq, fs, 0);
+   map.resize( mapSize(), mapSize());
    
-   return 0;
+   if( C_EvalMap(map, mapFunc, Cfunc, previewName(mapFile)) < 0) return -1;
+   
+   return C_MapCon(mapFile, map);
 }
 
 template<typename realT>
-int mxAOSystem_app<realT>::temporalPSDGridAnalyze()
+int mxAOSystem_app<realT>::writeCurves( std::ostream & out,
+                                        const std::vector<std::string> & names,
+                                        const std::vector<imageT> & ims
+                                      )
 {
-   mx::AO::analysis::fourierTemporalPSD<realT, aosysT> ftPSD;
-   ftPSD._aosys = &aosys;
+   if(ims.size() == 0) return 0;
    
-   if(gridDir == "")
+   if(!curveStats)
    {
-      std::cerr << "temporalPSDGridAnalyze: You must set gridDir.\n";
-      return -1;
+      std::vector<realT> row;
+      for(size_t c=0; c < ims.size(); ++c)
+      {
+         if(ims.size() > 1) out << "#" << names[c] << "\n";
+         
+         int rc = (ims[c].rows()-1)/2 + 1;
+         row.resize(ims[c].cols());
+         for(int j=0; j < ims[c].cols(); ++j) row[j] = ims[c](rc, j);
+         
+         writeRowCut(out, row);
+      }
+      
+      return 0;
    }
    
-   if(subDir == "")
+   if(curveBinWidth <= 0)
    {
-      std::cerr << "temporalPSDGridAnalyze: You must set subDir.\n";
+      std::cerr << "writeCurves: You must set curveBinWidth to be > 0.\n";
       return -1;
    }
    
-   if(aosys.fit_mn_max() <= 0)
+   radialBinIndex<realT> rbi;
+   rbi.build(ims[0].rows(), ims[0].cols(), curveBinWidth*mapOversamp, 0);
+   
+   std::vector<imageT> curves(ims.size());
+   for(size_t c=0; c < ims.size(); ++c)
    {
-      std::cerr << "temporalPSDGridAnalyze: You must set fit_mn_max to be > 0.\n";
-      return -1;
+      rbi.stats(curves[c], ims[c], curvePercentiles);
+   }
+   
+   out << "#sep";
+   for(size_t c=0; c < ims.size(); ++c)
+   {
+      out << " " << names[c] << "mean " << names[c] << "median";
+      for(size_t p=0; p < curvePercentiles.size(); ++p) out << " " << names[c] << "p" << curvePercentiles[p];
+   }
+   out << "\n";
+   
+   for(size_t b=0; b < rbi.nBins(); ++b)
+   {
+      out << rbi.binRadius[b]/mapOversamp;
+      for(size_t c=0; c < curves.size(); ++c)
+      {
+         for(int k=0; k < curves[c].cols(); ++k) out << " " << curves[c](b,k);
+      }
+      out << "\n";
    }
-      
-   int mnCon = aosys.D()/aosys.d_min()/2;
    
+   return 0;
+}
 
-   std::vector<realT> mags;
+template<typename realT>
+void mxAOSystem_app<realT>::writeRowCut( std::ostream & out,
+                                         const std::vector<realT> & row
+                                       )
+{
+   int c = (row.size()-1)/2 + 1;
    
-   if(starMags.size() == 0)
+   for(int i=0; i < mnMap; ++i)
    {
-      mags = { aosys.starMag() };
+      size_t j = c + round(i*mapOversamp);
+      if(j >= row.size()) break;
+      
+      out << i << " " << row[j] << "\n";
    }
-   else
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::C_Raw( const std::vector<CFuncT> & Cfuncs )
+{
+   if(curveOversamp <= 0)
    {
-      mags = starMags;
+      std::cerr << "C_Raw: You must set curveOversamp to be > 0.\n";
+      return -1;
    }
    
-   ftPSD.analyzePSDGrid( subDir, gridDir, aosys.fit_mn_max(), mnCon, lpNc, mags, intTimes); 
-   
+   //The number of points of each curve
+   int N = (curveOversamp == 1) ? aosys.fit_mn_max() : aosys.fit_mn_max()*curveOversamp;
    
+   //Derivatives of every point of every curve, row i*Cfuncs.size() + c
+   Eigen::Array<realT, -1, -1> grad;
+   if(gradParams.size() > 0)
+   {
+      std::vector<sysParam<realT, aosysT>> params;
+      if(gradParamList(params) < 0) return -1;
+      
+      realT os = curveOversamp;
+      
+      auto curves = [&](Eigen::Array<realT, -1, 1> & out, const aosysSnapshot<aosysT> & s)
+      {
+         out.resize(N*Cfuncs.size());
+         s.eval( [&](aosysT & a)
+                 {
+                    for(int i=0; i < N; ++i)
+                    {
+                       for(size_t c=0; c < Cfuncs.size(); ++c) out(i*Cfuncs.size() + c) = (a.*Cfuncs[c])(i/os, 0, false);
+                    }
+                 });
+         return 0;
+      };
+      
+      if(paramGradient(grad, sys, params, gradStep, curves) < 0) return -1;
+   }
+   
+   auto printGrad = [&](int i)
+   {
+      for(int p=0; p < grad.cols(); ++p)
+      {
+         for(size_t c=0; c < Cfuncs.size(); ++c) std::cout << " " << grad(i*Cfuncs.size() + c, p);
+      }
+   };
+   
+   //Fast path: integer lattice points
+   if(curveOversamp == 1)
+   {
+      for(int i=0;i< N; ++i)
+      {
+         std::cout << i;
+         for(size_t c=0; c < Cfuncs.size(); ++c) std::cout << " " << (aosys.*Cfuncs[c])(i,0, false);
+         printGrad(i);
+         std::cout << "\n";
+      }
+      
+      return 0;
+   }
+   
+   for(int i=0;i< N; ++i)
+   {
+      realT m = i/curveOversamp;
+      
+      std::cout << m;
+      for(size_t c=0; c < Cfuncs.size(); ++c) std::cout << " " << (aosys.*Cfuncs[c])(m,0, false);
+      printGrad(i);
+      std::cout << "\n";
+   }
+   
+   return 0;
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::C0Raw()
+{
+   return C_Raw({&aosysT::C0});
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::C0Map()
+{
+   return C_Map("C0Map.fits", &aosysT::template C0Map<imageT>, &aosysT::C0);
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::C1Raw()
+{
+   return C_Raw({&aosysT::C1});
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::C1Map()
+{
+   return C_Map("C1Map.fits", &aosysT::template C1Map<imageT>, &aosysT::C1);
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::C2Raw()
+{
+   return C_Raw({&aosysT::C2});
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::C2Map()
+{
+   return C_Map("C2Map.fits", &aosysT::template C2Map<imageT>, &aosysT::C2);
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::C4Raw()
+{
+   return C_Raw({&aosysT::C4});
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::C4Map()
+{
+   return C_Map("C4Map.fits", &aosysT::template C4Map<imageT>, &aosysT::C4);
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::C6Raw()
+{
+   return C_Raw({&aosysT::C6});
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::C6Map()
+{
+   return C_Map("C6Map.fits", &aosysT::template C6Map<imageT>, &aosysT::C6);
+}
+
+
+template<typename realT>
+int mxAOSystem_app<realT>::C7Raw()
+{
+   return C_Raw({&aosysT::C7});
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::C7Map()
+{
+   return C_Map("C7Map.fits", &aosysT::template C7Map<imageT>, &aosysT::C7);
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::CAllRaw()
+{
+   return C_Raw({&aosysT::C0, &aosysT::C1, &aosysT::C2, &aosysT::C4, &aosysT::C6, &aosysT::C7});
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::CAllMap()
+{
+   std::vector<std::string> names = {"C0", "C1", "C2", "C4", "C6", "C7"};
+   std::vector<CMapFuncT> mapFuncs = { &aosysT::template C0Map<imageT>, &aosysT::template C1Map<imageT>, &aosysT::template C2Map<imageT>,
+                                       &aosysT::template C4Map<imageT>, &aosysT::template C6Map<imageT>, &aosysT::template C7Map<imageT> };
+   std::vector<CFuncT> Cfuncs = { &aosysT::C0, &aosysT::C1, &aosysT::C2, &aosysT::C4, &aosysT::C6, &aosysT::C7 };
+   
+   if(mapOversamp <= 0)
+   {
+      std::cerr << "CAllMap: You must set mapOversamp to be > 0.\n";
+      return -1;
+   }
+   
+   if(mapTile > 0)
+   {
+      for(size_t c=0; c < names.size(); ++c)
+      {
+         std::cout << "#" << names[c] << "\n";
+         if( C_MapTiled(names[c] + "Map.fits", Cfuncs[c]) < 0) return -1;
+      }
+      
+      return 0;
+   }
+   
+   //The map, the PSF, and the kept images
+   if(!budget.fits((2 + names.size())*mapSize()*mapSize()*sizeof(realT)))
+   {
+      std::cerr << "CAllMap: " << names.size() << " " << mapSize() << "x" << mapSize() << " maps do not fit in the memory budget.  Use mapTile.\n";
+      return -1;
+   }
+   memoryLease lease(budget, (2 + names.size())*mapSize()*mapSize()*sizeof(realT));
+   
+   std::vector<imageT> ims(names.size());
+   
+   imageT map;
+   map.resize( mapSize(), mapSize());
+   
+   for(size_t c=0; c < names.size(); ++c)
+   {
+      if( C_EvalMap(map, mapFuncs[c], Cfuncs[c], previewName(names[c] + "Map.fits")) < 0) return -1;
+      
+      C_Convolve(ims[c], map);
+      
+      writer.push( [this, mapFile = names[c] + "Map.fits", im = ims[c]]() mutable
+                   {
+                      return writeFits(mapFile, im);
+                   });
+   }
+   
+   return writeCurves(std::cout, names, ims);
+}
+
+
+template<typename realT>
+int mxAOSystem_app<realT>::ErrorBudget()
+{
+   if(band.active()) return ErrorBudgetBand();
+   
+   typedef Eigen::Array<realT, -1, 1> termsT;
+   
+   realT units = 1;
+   
+   if(wfeUnits == "nm")
+   {
+      std::cerr << aosys.lam_sci() << "\n";
+      units = aosys.lam_sci() / (2.0*pi<realT>()) / 1e-9;
+   }
+   
+   std::vector<realT> mags = starMags;
+   if(mags.size() == 0) mags = { aosys.starMag() };
+   
+   Eigen::Array<realT, -1, -1> terms;
+   std::vector<realT> bestTau;
+   if(errorBudgetBatch(terms, bestTau, sys, mags, tauWFSCandidates) < 0) return -1;
+   
+   //RMS in the output units, and the Strehl ratio
+   terms.topRows(ebStrehl) = terms.topRows(ebStrehl).sqrt()*units;
+   
+   std::vector<termsT> budgets(mags.size());
+   for(size_t i=0; i < mags.size(); ++i) budgets[i] = terms.col(i);
+   
+   if(starMags.size() == 0)
+   {
+      std::cout << "Measurement: " << budgets[0](0) << "\n";
+      std::cout << "Time-delay:  " << budgets[0](1) << "\n";
+      std::cout << "Fitting:     " << budgets[0](2) << "\n";
+      std::cout << "NCP error:   " << budgets[0](6) << "\n";
+      std::cout << "Strehl:      " << budgets[0](7) << "\n";
+      if(tauWFSCandidates.size() > 0) std::cout << "tauWFS:      " << bestTau[0] << "\n";
+   }
+   else
+   {
+      std::cout << "#mag     Measurement     Time-delay      Fitting    Chr-Scint-OPD      Chr-Index   Disp-Ansio-OPD  NCP-error         Strehl";
+      if(tauWFSCandidates.size() > 0) std::cout << "         tauWFS";
+      std::cout << "\n";
+      
+      for(size_t i=0; i< mags.size(); ++i)
+      {
+         std::cout << mags[i] << "\t    ";
+         std::cout << budgets[i](0) << "\t   ";
+         std::cout << budgets[i](1) << "\t ";
+         std::cout << budgets[i](2) << "\t ";
+         std::cout << budgets[i](3) << "\t    ";
+         std::cout << budgets[i](4) << "\t\t    ";
+         std::cout << budgets[i](5) << "\t    ";
+         std::cout << budgets[i](6) << "\t\t";
+         std::cout << budgets[i](7);
+         if(tauWFSCandidates.size() > 0) std::cout << "\t\t" << bestTau[i];
+         std::cout << "\n";
+      }
+   }
+   
+   if(gradParams.size() > 0) return ErrorBudgetGradient(mags, bestTau);
+      
+   return 0;
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::gradParamList( std::vector<sysParam<realT, aosysT>> & params )
+{
+   if(gradStep <= 0)
+   {
+      std::cerr << "gradParams: You must set gradStep to be > 0.\n";
+      return -1;
+   }
+   
+   params.resize(gradParams.size());
+   for(size_t p=0; p < gradParams.size(); ++p)
+   {
+      if(findSysParam(params[p], gradParams[p]) < 0) return -1;
+   }
+   
+   return 0;
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::ErrorBudgetGradient( const std::vector<realT> & mags,
+                                                const std::vector<realT> & bestTau
+                                              )
+{
+   std::vector<sysParam<realT, aosysT>> params;
+   if(gradParamList(params) < 0) return -1;
+   
+   //The printed budget at the snapshot's own magnitude and integration time
+   auto budget = [this](Eigen::Array<realT, -1, 1> & out, const aosysSnapshot<aosysT> & s)
+   {
+      std::vector<realT> mag = { s.eval( [](aosysT & a){ return (realT) a.starMag(); } ) };
+      
+      Eigen::Array<realT, -1, -1> terms;
+      if(errorBudgetBatch(terms, s, mag) < 0) return -1;
+      
+      realT units = 1;
+      if(wfeUnits == "nm") units = s.eval( [](aosysT & a){ return (realT) a.lam_sci(); } ) / (2.0*pi<realT>()) / 1e-9;
+      
+      out = terms.col(0);
+      out.head(ebStrehl) = out.head(ebStrehl).sqrt()*units;
+      
+      return 0;
+   };
+   
+   std::cout << "\n#d/dparam  mag      Measurement     Time-delay      Fitting    Chr-Scint-OPD      Chr-Index   Disp-Ansio-OPD  NCP-error         Strehl\n";
+   
+   for(size_t i=0; i < mags.size(); ++i)
+   {
+      aosysSnapshot<aosysT> magSys = sys.derive( [&](aosysT & s)
+                                                 {
+                                                    s.starMag(mags[i]);
+                                                    if(bestTau[i] > 0) fixTauWFS(s, bestTau[i]);
+                                                 });
+      
+      Eigen::Array<realT, -1, -1> grad;
+      if(paramGradient(grad, magSys, params, gradStep, budget) < 0) return -1;
+      
+      for(size_t p=0; p < params.size(); ++p)
+      {
+         std::cout << params[p].name << "\t   " << mags[i];
+         for(int k=0; k < grad.rows(); ++k) std::cout << "\t" << grad(k,p);
+         std::cout << "\n";
+      }
+   }
+   
+   return 0;
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::ErrorBudgetMC()
+{
+   typedef std::chrono::steady_clock clockT;
+   
+   if(mcSamples < 1)
+   {
+      std::cerr << "ErrorBudgetMC: You must set mcSamples to be >= 1.\n";
+      return -1;
+   }
+   
+   for(size_t t=0; t < tauWFSCandidates.size(); ++t)
+   {
+      if(tauWFSCandidates[t] <= 0)
+      {
+         std::cerr << "ErrorBudgetMC: integration times must be > 0.\n";
+         return -1;
+      }
+   }
+   
+   for(size_t q=0; q < mcQuantiles.size(); ++q)
+   {
+      if(mcQuantiles[q] < 0 || mcQuantiles[q] > 100)
+      {
+         std::cerr << "ErrorBudgetMC: mcQuantiles must be in [0,100].\n";
+         return -1;
+      }
+   }
+   
+   //The distributions, name:dist:a:b
+   std::vector<sysParam<realT, aosysT>> params(mcParams.size());
+   std::vector<mcDist> dists(mcParams.size());
+   std::vector<realT> pa(mcParams.size()), pb(mcParams.size());
+   bool sampleMag = false;
+   
+   for(size_t p=0; p < mcParams.size(); ++p)
+   {
+      std::vector<std::string> fields;
+      std::stringstream ss(mcParams[p]);
+      std::string f;
+      while(std::getline(ss, f, ':')) fields.push_back(f);
+      
+      if(fields.size() != 4)
+      {
+         std::cerr << "ErrorBudgetMC: " << mcParams[p] << " must be name:dist:a:b.\n";
+         return -1;
+      }
+      
+      if(findSysParam(params[p], fields[0]) < 0) return -1;
+      if(fields[0] == "starMag") sampleMag = true;
+      
+      if(fields[1] == "normal") dists[p] = mcNormal;
+      else if(fields[1] == "lognormal") dists[p] = mcLognormal;
+      else if(fields[1] == "uniform") dists[p] = mcUniform;
+      else
+      {
+         std::cerr << "ErrorBudgetMC: unknown distribution " << fields[1] << ", must be normal, lognormal, or uniform.\n";
+         return -1;
+      }
+      
+      try
+      {
+         pa[p] = std::stod(fields[2]);
+         pb[p] = std::stod(fields[3]);
+      }
+      catch(...)
+      {
+         std::cerr << "ErrorBudgetMC: invalid number in " << mcParams[p] << "\n";
+         return -1;
+      }
+      
+      if( (dists[p] == mcNormal && pb[p] < 0) || (dists[p] == mcLognormal && (pa[p] <= 0 || pb[p] < 0)) || (dists[p] == mcUniform && pb[p] < pa[p]) )
+      {
+         std::cerr << "ErrorBudgetMC: invalid parameters in " << mcParams[p] << "\n";
+         return -1;
+      }
+      
+      //Parameters which can not be negative are drawn from the positive part of a normal, and uniforms must not reach below 0
+      if(params[p].nonNeg && ( (dists[p] == mcNormal && pa[p] <= 0) || (dists[p] == mcUniform && pa[p] < 0) ))
+      {
+         std::cerr << "ErrorBudgetMC: " << fields[0] << " can not be negative, so in " << mcParams[p] << " the " << (dists[p] == mcNormal ? "mean must be > 0" : "min must be >= 0") << ".\n";
+         return -1;
+      }
+   }
+   
+   //A sampled magnitude replaces the list
+   std::vector<realT> mags = starMags;
+   if(mags.size() == 0 || sampleMag) mags = { aosys.starMag() };
+   
+   size_t nOut = mags.size()*ebNTerms;
+   
+   std::vector<runningStats<realT>> stats(nOut);
+   std::vector<std::vector<p2Quantile<realT>>> quants(nOut);
+   for(size_t o=0; o < nOut; ++o)
+   {
+      for(size_t q=0; q < mcQuantiles.size(); ++q) quants[o].push_back( p2Quantile<realT>(mcQuantiles[q]/100) );
+   }
+   
+   const size_t blockSize = 1024; //Samples per generator
+   size_t nSamples = mcSamples;
+   size_t nBlocks = (nSamples + blockSize - 1)/blockSize;
+   
+   int nThreads = omp_get_max_threads();
+   size_t chunkBlocks = 4*nThreads;
+   
+   //The chunk is the only buffer which grows with the threads, so it is shrunk to fit the memory budget
+   while(chunkBlocks > 1 && !budget.fits(nOut*chunkBlocks*blockSize*sizeof(realT))) chunkBlocks /= 2;
+   memoryLease lease(budget, nOut*chunkBlocks*blockSize*sizeof(realT));
+   
+   Eigen::Array<realT, -1, -1> chunk(nOut, chunkBlocks*blockSize);
+   size_t nRedrawn = 0;
+   
+   auto t0 = clockT::now();
+   
+   for(size_t b0 = 0; b0 < nBlocks; b0 += chunkBlocks)
+   {
+      size_t b1 = std::min(nBlocks, b0 + chunkBlocks);
+      
+      #pragma omp parallel
+      {
+         aosysT lsys = sys.get();
+         Eigen::Array<realT, -1, 1> terms;
+         
+         #pragma omp for schedule(dynamic) reduction(+:nRedrawn)
+         for(size_t b = b0; b < b1; ++b)
+         {
+            std::seed_seq seq{ (uint32_t) mcSeed, (uint32_t) b, (uint32_t) ( (uint64_t) b >> 32) };
+            std::mt19937_64 gen(seq);
+            
+            size_t s1 = std::min(nSamples, (b+1)*blockSize);
+            for(size_t k = b*blockSize; k < s1; ++k)
+            {
+               for(size_t p=0; p < params.size(); ++p)
+               {
+                  realT v;
+                  if(dists[p] == mcUniform) v = std::uniform_real_distribution<realT>(pa[p], pb[p])(gen);
+                  else if(dists[p] == mcLognormal) v = std::lognormal_distribution<realT>(log(pa[p]), pb[p])(gen);
+                  else
+                  {
+                     v = std::normal_distribution<realT>(pa[p], pb[p])(gen);
+                     while(params[p].nonNeg && v <= 0)
+                     {
+                        v = std::normal_distribution<realT>(pa[p], pb[p])(gen);
+                        ++nRedrawn;
+                     }
+                  }
+                  
+                  params[p].set(lsys, v);
+               }
+               
+               realT units = 1;
+               if(wfeUnits == "nm") units = lsys.lam_sci() / (2.0*pi<realT>()) / 1e-9;
+               
+               for(size_t i=0; i < mags.size(); ++i)
+               {
+                  if(!sampleMag) lsys.starMag(mags[i]);
+                  errorBudgetTerms(terms, lsys, tauWFSCandidates);
+                  
+                  terms.head(ebStrehl) = terms.head(ebStrehl).sqrt()*units;
+                  chunk.col(k - b0*blockSize).segment(i*ebNTerms, ebNTerms) = terms;
+               }
+            }
+         }
+      }
+      
+      //In sample order, so the quantile estimates do not depend on the threads
+      size_t n = std::min(nSamples, b1*blockSize) - b0*blockSize;
+      for(size_t k=0; k < n; ++k)
+      {
+         for(size_t o=0; o < nOut; ++o)
+         {
+            stats[o].add(chunk(o,k));
+            for(size_t q=0; q < quants[o].size(); ++q) quants[o][q].add(chunk(o,k));
+         }
+      }
+   }
+   
+   double wall = std::chrono::duration<double>(clockT::now() - t0).count();
+   std::cerr << "ErrorBudgetMC: " << nSamples << " samples in " << wall << " s on " << nThreads << " threads, " << nSamples/wall << " samples/s\n";
+   
+   std::vector<std::string> names = {"Measurement", "Time-delay", "Fitting", "Chr-Scint-OPD", "Chr-Index", "Disp-Aniso-OPD", "NCP-error", "Strehl"};
+   
+   std::cout << "#Monte Carlo error budget: " << nSamples << " samples, seed " << mcSeed;
+   if(nRedrawn > 0) std::cout << ", " << nRedrawn << " negative draws redrawn";
+   std::cout << "\n";
+   std::cout << "#mag\tterm\tmean\tstd\tmin";
+   for(size_t q=0; q < mcQuantiles.size(); ++q) std::cout << "\tp" << mcQuantiles[q];
+   std::cout << "\tmax\n";
+   
+   for(size_t i=0; i < mags.size(); ++i)
+   {
+      for(size_t t=0; t < ebNTerms; ++t)
+      {
+         const runningStats<realT> & st = stats[i*ebNTerms + t];
+         
+         std::cout << mags[i] << "\t" << names[t] << "\t" << st.mean() << "\t" << sqrt(st.variance()) << "\t" << st.min();
+         for(size_t q=0; q < mcQuantiles.size(); ++q) std::cout << "\t" << quants[i*ebNTerms + t][q].value();
+         std::cout << "\t" << st.max() << "\n";
+      }
+   }
+   
+   return 0;
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::ErrorBudgetBand()
+{
+   typedef Eigen::Array<realT, -1, 1> termsT;
+   
+   realT lam0 = aosys.lam_sci();
+   
+   std::vector<realT> mags = starMags;
+   if(mags.size() == 0) mags = { aosys.starMag() };
+   
+   std::vector<termsT> budgets(mags.size());
+   
+   //Achromatic in OPD, so the measurement, time-delay, and fitting errors scale as lam^-2
+   Eigen::Array<realT, -1, -1> terms0;
+   std::vector<realT> bestTau;
+   if(errorBudgetBatch(terms0, bestTau, sys, mags, tauWFSCandidates) < 0) return -1;
+   
+   for(size_t i=0; i < mags.size(); ++i)
+   {
+      aosysSnapshot<aosysT> magSys = sys.derive( [&](aosysT & s)
+                                                 {
+                                                    s.starMag(mags[i]);
+                                                    if(bestTau[i] > 0) fixTauWFS(s, bestTau[i]);
+                                                 });
+      
+      realT meas0 = terms0(ebMeasurement, i);
+      realT td0 = terms0(ebTimeDelay, i);
+      realT fit0 = terms0(ebFitting, i);
+      
+      auto eval = [&](termsT & val, realT lam)
+      {
+         aosysT lsys = magSys.get();
+         lsys.lam_sci(lam);
+         
+         realT sc = pow(lam0/lam, 2);
+         
+         val.resize(8);
+         val(0) = meas0*sc;
+         val(1) = td0*sc;
+         val(2) = fit0*sc;
+         val(3) = lsys.chromScintOPDError();
+         val(4) = lsys.chromIndexError();
+         val(5) = lsys.dispAnisoOPDError();
+         val(6) = lsys.ncpError();
+         val(7) = exp( -val.head(7).sum());
+         
+         if(wfeUnits == "nm") val.head(7) *= pow(lam / (2.0*pi<realT>()) / 1e-9, 2);
+      };
+      
+      if(bandIntegrate(budgets[i], band, eval, bandTol, bandMaxDepth) < 0) return -1;
+   }
+   
+   if(starMags.size() == 0)
+   {
+      std::cout << "Measurement:    " << sqrt(budgets[0](0)) << "\n";
+      std::cout << "Time-delay:     " << sqrt(budgets[0](1)) << "\n";
+      std::cout << "Fitting:        " << sqrt(budgets[0](2)) << "\n";
+      std::cout << "Chr-Scint-OPD:  " << sqrt(budgets[0](3)) << "\n";
+      std::cout << "Chr-Index:      " << sqrt(budgets[0](4)) << "\n";
+      std::cout << "Disp-Aniso-OPD: " << sqrt(budgets[0](5)) << "\n";
+      std::cout << "NCP error:      " << sqrt(budgets[0](6)) << "\n";
+      std::cout << "Strehl:         " << budgets[0](7) << "\n";
+      if(tauWFSCandidates.size() > 0) std::cout << "tauWFS:         " << bestTau[0] << "\n";
+      
+      return 0;
+   }
+   
+   std::cout << "#mag     Measurement     Time-delay      Fitting    Chr-Scint-OPD      Chr-Index   Disp-Ansio-OPD  NCP-error         Strehl";
+   if(tauWFSCandidates.size() > 0) std::cout << "         tauWFS";
+   std::cout << "\n";
+   
+   for(size_t i=0; i< mags.size(); ++i)
+   {
+      std::cout << mags[i] << "\t    ";
+      std::cout << sqrt(budgets[i](0)) << "\t   ";
+      std::cout << sqrt(budgets[i](1)) << "\t ";
+      std::cout << sqrt(budgets[i](2)) << "\t ";
+      std::cout << sqrt(budgets[i](3)) << "\t    ";
+      std::cout << sqrt(budgets[i](4)) << "\t\t    ";
+      std::cout << sqrt(budgets[i](5)) << "\t    ";
+      std::cout << sqrt(budgets[i](6)) << "\t\t";
+      std::cout << budgets[i](7);
+      if(tauWFSCandidates.size() > 0) std::cout << "\t\t" << bestTau[i];
+      std::cout << "\n";
+   }
+   
+   return 0;
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::Strehl()
+{
+   std::cout << aosys.strehl() << "\n";
+   
+   return 0;
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::temporalPSD()
+{
+   std::vector<realT> freq, psd;
+
+   mx::AO::analysis::fourierTemporalPSD<realT, aosysT> ftPSD;
+   ftPSD._aosys = &aosys;
+   
+   if(aosys.minTauWFS() <= 0)
+   {
+      std::cerr << "temporalPSD: You must set minTauWFS to be > 0 to specify loop frequency.\n";
+      return -1;
+   }
+   
+   if(dfreq <= 0)
+   {
+      std::cerr << "temporalPSD: You must set dfreq to be > 0 to specify frequency sampling.\n";
+      return -1;
+   }
+   
+   realT fs = 1.0/aosys.minTauWFS();
+   
+   mx::math::vectorScale(freq, 0.5*fs/dfreq, dfreq, dfreq);
+   psd.resize(freq.size());
+   
+   ftPSD.multiLayerPSD( psd, freq, k_m, k_n, 1, kmax);
+   
+   
+   for(int i=0; i < freq.size(); ++i)
+   {
+      std::cout << freq[i] << " " << psd[i] << "\n";
+   }
+   
+   return 0;
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::makePSDGrid( const std::string & dir,
+                                        int mnMax,
+                                        realT dFreq,
+                                        realT maxFreq,
+                                        realT fmax
+                                      )
+{
+   //Make sure we get to at least maxFreq
+   int N = maxFreq/dFreq;
+   if( N * dFreq < maxFreq) N += 1;
+   
+   mkdir(dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+   
+   std::ofstream fout;
+   fout.open(dir + "/params.txt");
+   aosys.dumpAOSystem(fout);
+   fout << "#---------------------------\n";
+   fout << "# PSD Grid Parameters\n";
+   fout << "#    mnMax = " << mnMax << "\n";
+   fout << "#    dFreq = " << dFreq << "\n";
+   fout << "#    maxFreq = " << maxFreq << "\n";
+   fout << "#    fmax = " << fmax << "\n";
+   fout << "#---------------------------\n";
+   fout.close();
+   
+   std::vector<realT> freq;
+   mx::math::vectorScale(freq, N, dFreq, dFreq);
+   
+   if( mx::ioutils::writeBinVector( dir + "/freq.binv", freq) < 0)
+   {
+      std::cerr << "makePSDGrid: error writing " << dir << "/freq.binv\n";
+      return -1;
+   }
+   
+   //The PSDs scale as r_0^(-5/3), so a normalized grid is for r_0 = 1 m
+   realT psdNorm = 1;
+   gridFormat.r_0 = aosys.atm.r_0();
+   gridFormat.lam_0 = aosys.atm.lam_0();
+   if(gridNormalize)
+   {
+      psdNorm = pow(gridFormat.r_0, 5.0/3.0);
+      gridFormat.r_0 = 1;
+   }
+   gridFormat.normalized = gridNormalize;
+   
+   //A layered grid stores each layer's PSD, -1 is the total
+   std::vector<int> layers = {-1};
+   gridFormat.layers = 0;
+   gridFormat.layerCn2.clear();
+   if(gridLayers)
+   {
+      gridFormat.layers = aosys.atm.n_layers();
+      layers.resize(gridFormat.layers);
+      for(int l = 0; l < gridFormat.layers; ++l)
+      {
+         layers[l] = l;
+         gridFormat.layerCn2.push_back(aosys.atm.layer_Cn2(l));
+      }
+   }
+   
+   if(writeGridFormat(dir, gridFormat) < 0) return -1;
+   
+   //Since the PSDs of (m,n) and (-m,-n) are the same, only the half-plane is calculated
+   std::vector<std::array<int,2>> mn;
+   for(int m = 0; m <= mnMax; ++m)
+   {
+      for(int n = -mnMax; n <= mnMax; ++n)
+      {
+         if(m == 0 && n <= 0) continue;
+         mn.push_back({m,n});
+      }
+   }
+   
+   bool toFloat = (gridFormat.precision == "float");
+   
+   //The PSD, plus its conversion when written
+   size_t psdBytes = freq.size()*(sizeof(realT) + (toFloat ? sizeof(float) : sizeof(realT)));
+   
+   std::vector<realT> maxRelErr, varRelErr;
+   std::vector<int> nOutside;
+   if(toFloat)
+   {
+      maxRelErr.resize(mn.size(), 0);
+      varRelErr.resize(mn.size(), 0);
+      nOutside.resize(mn.size(), 0);
+   }
+   
+   //The writer thread is started before the workers are pinned, so it keeps the process affinity
+   if(numaPin) writer.start();
+   
+   auto t0 = std::chrono::steady_clock::now();
+   int nThreads = 1;
+   
+   #pragma omp parallel
+   {
+      #pragma omp single
+      nThreads = omp_get_num_threads();
+      
+      //Pin before allocating, so the copies below are first-touched on this thread's node
+      cpu_set_t prevCpus;
+      bool pinned = numaPin && numa.pinThread(omp_get_thread_num(), omp_get_num_threads(), &prevCpus) >= 0;
+      
+      aosysT lsys = sys.get();
+      std::vector<realT> lfreq = freq;
+      
+      //Each thread gets its own integrator workspace
+      mx::AO::analysis::fourierTemporalPSD<realT, aosysT> ftPSD;
+      ftPSD._aosys = &lsys;
+      
+      #pragma omp for schedule(dynamic)
+      for(size_t k = 0; k < mn.size(); ++k)
+      {
+         for(size_t l = 0; l < layers.size(); ++l)
+         {
+            //Held until the PSD is written
+            budget.acquire(psdBytes);
+            
+            std::vector<realT> PSD(lfreq.size());
+            
+            if(layers[l] < 0) ftPSD.multiLayerPSD( PSD, lfreq, mn[k][0], mn[k][1], 1, fmax);
+            else ftPSD.singleLayerPSD( PSD, lfreq, mn[k][0], mn[k][1], layers[l], 1, fmax);
+            
+            if(psdNorm != 1)
+            {
+               for(size_t i=0; i < PSD.size(); ++i) PSD[i] *= psdNorm;
+            }
+            
+            if(toFloat)
+            {
+               //Compare in log-aware relative terms, since the PSD spans many decades
+               realT var = 0, fvar = 0;
+               for(size_t i=0; i < PSD.size(); ++i)
+               {
+                  realT fp = static_cast<float>(PSD[i]);
+                  
+                  var += PSD[i];
+                  fvar += fp;
+                  
+                  if(PSD[i] == 0) continue;
+                  
+                  if(fabs(PSD[i]) < std::numeric_limits<float>::min() || fabs(PSD[i]) > std::numeric_limits<float>::max())
+                  {
+                     ++nOutside[k];
+                     continue;
+                  }
+                  
+                  maxRelErr[k] = std::max(maxRelErr[k], fabs(fp - PSD[i])/fabs(PSD[i]));
+               }
+            
+               if(var != 0) varRelErr[k] = std::max(varRelErr[k], fabs(fvar - var)/fabs(var));
+            }
+            
+            writer.push( [this, psdBytes, dir, m = mn[k][0], n = mn[k][1], layer = layers[l], PSD = std::move(PSD), fmt = gridFormat]() mutable
+                         {
+                            int rv = writeGridPSD(dir, m, n, PSD, fmt, layer);
+                         
+                            PSD = std::vector<realT>();
+                            budget.release(psdBytes);
+                         
+                            return rv;
+                         });
+         }
+      }
+      
+      //The master thread continues after the region, so it must not stay pinned
+      if(pinned) numa.unpinThread(prevCpus);
+   }
+   
+   reportScaling("makePSDGrid", mn.size(), nThreads, t0);
+   
+   if(toFloat)
+   {
+      fout.open(dir + "/precision.txt");
+      fout << "#m n maxRelErr varRelErr nOutside\n";
+      
+      realT worstRel = 0, worstVar = 0;
+      int totOutside = 0;
+      for(size_t k = 0; k < mn.size(); ++k)
+      {
+         fout << mn[k][0] << " " << mn[k][1] << " " << maxRelErr[k] << " " << varRelErr[k] << " " << nOutside[k] << "\n";
+         
+         worstRel = std::max(worstRel, maxRelErr[k]);
+         worstVar = std::max(worstVar, varRelErr[k]);
+         totOutside += nOutside[k];
+      }
+      fout.close();
+      
+      std::cerr << "makePSDGrid: float storage: max relative error " << worstRel << ", max variance relative error " << worstVar;
+      std::cerr << ", " << totOutside << " values outside the float normal range.  See " << dir << "/precision.txt\n";
+   }
+   
+   return 0;
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::temporalPSDGrid()
+{
+   if(gridDir == "")
+   {
+      std::cerr << "temporalPSDGrid: You must set gridDir.\n";
+      return -1;
+   }
+   
+   if(aosys.fit_mn_max() <= 0)
+   {
+      std::cerr << "temporalPSDGrid: You must set fit_mn_max to be > 0.\n";
+      return -1;
+   }
+   
+
+   if(dfreq <= 0)
+   {
+      std::cerr << "temporalPSDGrid: You must set dfreq to be > 0 to specify frequency sampling.\n";
+      return -1;
+   }
+   
+   if(aosys.minTauWFS() <= 0)
+   {
+      std::cerr << "temporalPSDGrid: You must set minTauWFS to be > 0 to specify loop frequency.\n";
+      return -1;
+   }
+   
+   if(gridFormat.format != "binv" && gridFormat.format != "fits")
+   {
+      std::cerr << "temporalPSDGrid: Unknown gridFormat: " << gridFormat.format << "\n";
+      return -1;
+   }
+   
+   if(gridFormat.precision != "double" && gridFormat.precision != "float")
+   {
+      std::cerr << "temporalPSDGrid: Unknown gridPrecision: " << gridFormat.precision << "\n";
+      return -1;
+   }
+   
+   if(gridFormat.format == "fits")
+   {
+      //Check the compression settings before starting
+      fitsTileFile<realT> ff;
+      if(ff.compression(gridFormat.compress, gridFormat.quantize) < 0) return -1;
+   }
+   
+   realT fs = 1.0/aosys.minTauWFS();
+   
+   return makePSDGrid( gridDir, aosys.fit_mn_max(), dfreq, fs, 0);
+}
+
+template<typename realT>
+void mxAOSystem_app<realT>::foldPSD( std::vector<realT> & tfreq,
+                                     std::vector<realT> & tpsd,
+                                     const std::vector<realT> & freq,
+                                     const std::vector<realT> & psd,
+                                     realT fs
+                                   )
+{
+   realT df = freq[1] - freq[0];
+   
+   size_t Nt = 0;
+   while(Nt < freq.size() && freq[Nt] <= 0.5*fs) ++Nt;
+   
+   tfreq.assign(freq.begin(), freq.begin() + Nt);
+   tpsd.assign(psd.begin(), psd.begin() + Nt);
+   
+   if(Nt == 0) return;
+   
+   for(size_t k = Nt; k < freq.size(); ++k)
+   {
+      realT fa = fmod(freq[k], fs);
+      if(fa > 0.5*fs) fa = fs - fa;
+      
+      long i = round( (fa - freq[0])/df);
+      if(i < 0) i = 0;
+      if(i >= (long) Nt) i = Nt-1;
+      
+      tpsd[i] += psd[k];
+   }
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::analyzeModePSD( std::vector<modeResult> & res,
+                                           aosysT & lsys,
+                                           std::vector<realT> & freq,
+                                           std::vector<realT> & psd,
+                                           int m,
+                                           int n,
+                                           const std::vector<int> & lpNc,
+                                           const std::vector<realT> & delays,
+                                           const std::vector<int> & intTimes
+                                         )
+{
+   std::vector<realT> tfreq, tPSDp, tPSDn;
+   
+   //The orders which are used
+   std::vector<int> orders;
+   for(size_t i = 0; i < lpNc.size(); ++i)
+   {
+      if(lpNc[i] > 1) orders.push_back(lpNc[i]);
+   }
+   
+   realT tau0 = lsys.minTauWFS();
+   
+   mx::AO::analysis::linearPredictor<realT> lp;
+   
+   res.resize(delays.size());
+   for(size_t d = 0; d < delays.size(); ++d)
+   {
+      res[d].m = m;
+      res[d].n = n;
+      res[d].var_si = std::numeric_limits<realT>::max();
+      res[d].tau_lp.assign(orders.size(), 0);
+      res[d].gopt_lp.assign(orders.size(), 0);
+      res[d].var_lp.assign(orders.size(), std::numeric_limits<realT>::max());
+   }
+   
+   for(size_t i = 0; i < intTimes.size(); ++i)
+   {
+      realT tau = intTimes[i]*tau0;
+      realT fs = 1.0/tau;
+      
+      foldPSD(tfreq, tPSDp, freq, psd, fs);
+      if(tfreq.size() < 2) continue;
+      
+      //The noise of this mode at tau, white over [0, fs/2]
+      fixTauWFS(lsys, tau);
+      tPSDn.assign(tfreq.size(), lsys.measurementError(m, n)/(0.5*fs));
+      
+      //The folded PSDs are the same for every delay
+      for(size_t d = 0; d < delays.size(); ++d)
+      {
+         realT var;
+         
+         mx::AO::analysis::clGainOpt<realT> go_si(tau, delays[d]);
+         go_si.f(tfreq);
+         
+         realT gopt = go_si.optGainOpenLoop(var, tPSDp, tPSDn);
+         
+         if(var < res[d].var_si)
+         {
+            res[d].tau_si = tau;
+            res[d].gopt_si = gopt;
+            res[d].var_si = var;
+         }
+         
+         for(size_t o = 0; o < orders.size(); ++o)
+         {
+            if(tfreq.size() < (size_t) orders[o] + 2) continue;
+            
+            mx::AO::analysis::clGainOpt<realT> go_lp(tau, delays[d]);
+            go_lp.f(tfreq);
+            
+            realT gmax_lp = 0, gopt_lp = 0, var_lp = 0;
+            lp.regularizeCoefficients( gmax_lp, gopt_lp, var_lp, go_lp, tPSDp, tPSDn, orders[o]);
+            
+            if(var_lp < res[d].var_lp[o])
+            {
+               res[d].tau_lp[o] = tau;
+               res[d].gopt_lp[o] = gopt_lp;
+               res[d].var_lp[o] = var_lp;
+            }
+         }
+      }
+   }
+   
+   return 0;
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::analyzePSDGrid( std::vector<gridCondition> & conds,
+                                           const std::string & psdDir,
+                                           int mnMax,
+                                           int mnCon,
+                                           const std::vector<int> & lpNc,
+                                           const std::vector<realT> & delays,
+                                           bool delayDirs,
+                                           std::vector<realT> & mags,
+                                           std::vector<int> & intTimes
+                                         )
+{
+   std::vector<realT> freq;
+   
+   if(mx::ioutils::readBinVector(freq, psdDir + "/freq.binv") < 0 || freq.size() < 2)
+   {
+      std::cerr << "analyzePSDGrid: error reading " << psdDir << "/freq.binv\n";
+      return -1;
+   }
+   
+   psdGridFormat fmt;
+   readGridFormat(fmt, psdDir);
+   
+   //The system of each condition
+   std::vector<aosysSnapshot<aosysT>> condSys(conds.size());
+   
+   for(size_t c = 0; c < conds.size(); ++c)
+   {
+      std::string dir = psdDir + "/" + conds[c].dir;
+      
+      //Make each level, for nested condition directories
+      for(size_t p = conds[c].dir.find('/'); p != std::string::npos; p = conds[c].dir.find('/', p+1))
+      {
+         mkdir( (psdDir + "/" + conds[c].dir.substr(0,p)).c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+      }
+      mkdir(dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+      
+      if(delayDirs)
+      {
+         for(size_t d = 0; d < delays.size(); ++d)
+         {
+            mkdir( (dir + "/delay_" + mx::ioutils::convertToString(delays[d])).c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+         }
+      }
+      
+      condSys[c] = sys.derive( [&](aosysT & s)
+                               {
+                                  if(conds[c].r_0 > 0) s.atm.r_0(conds[c].r_0, fmt.lam_0);
+                                  if(conds[c].windScale != 1) s.atm.v_wind(conds[c].windScale*s.atm.v_wind());
+                                  if(conds[c].cn2.size() > 0) s.atm.layer_Cn2(conds[c].cn2, 0);
+                               });
+      
+      std::ofstream fout;
+      fout.open(dir + "/params.txt");
+      aosysT csys = condSys[c].get();
+      csys.dumpAOSystem(fout);
+      fout << "#---------------------------\n";
+      fout << "# PSD Grid Analysis Parameters\n";
+      fout << "#    mnMax = " << mnMax << "\n";
+      fout << "#    mnCon = " << mnCon << "\n";
+      fout << "#    lpNc = ";
+      for(size_t i=0; i < lpNc.size(); ++i) fout << lpNc[i] << " ";
+      fout << "\n";
+      fout << "#    intTimes = ";
+      for(size_t i=0; i < intTimes.size(); ++i) fout << intTimes[i] << " ";
+      fout << "\n";
+      fout << "#    deltaTau = ";
+      for(size_t i=0; i < delays.size(); ++i) fout << delays[i] << " ";
+      fout << "\n";
+      fout << "#    grid r_0 = " << fmt.r_0 << "\n";
+      fout << "#    grid lam_0 = " << fmt.lam_0 << "\n";
+      fout << "#    PSD scale = " << conds[c].psdScale << "\n";
+      fout << "#    wind scale = " << conds[c].windScale << "\n";
+      if(conds[c].cn2.size() > 0)
+      {
+         fout << "#    layer Cn2 = ";
+         for(size_t i=0; i < conds[c].cn2.size(); ++i) fout << conds[c].cn2[i] << " ";
+         fout << "\n";
+      }
+      fout << "#---------------------------\n";
+      fout.close();
+   }
+   
+   //The controlled modes in the half-plane
+   std::vector<std::array<int,2>> mn;
+   for(int m = 0; m <= mnMax; ++m)
+   {
+      for(int n = -mnMax; n <= mnMax; ++n)
+      {
+         if(m == 0 && n <= 0) continue;
+         if(m > mnCon || abs(n) > mnCon) continue;
+         
+         mn.push_back({m,n});
+      }
+   }
+   
+   //results[c][s][k][d] for condition c, magnitude s, mode k, and delay d
+   size_t nOrders = 0;
+   for(size_t i = 0; i < lpNc.size(); ++i) if(lpNc[i] > 1) ++nOrders;
+   
+   size_t resBytes = conds.size()*mags.size()*mn.size()*delays.size()*(sizeof(modeResult) + 3*nOrders*sizeof(realT));
+   if(!budget.fits(resBytes))
+   {
+      std::cerr << "analyzePSDGrid: the results of " << conds.size() << " conditions, " << mags.size() << " magnitudes, and " << delays.size() << " delays do not fit in the memory budget.\n";
+      return -1;
+   }
+   memoryLease lease(budget, resBytes);
+   
+   std::vector<std::vector<std::vector<std::vector<modeResult>>>> results(conds.size(), std::vector<std::vector<std::vector<modeResult>>>(mags.size(), std::vector<std::vector<modeResult>>(mn.size())));
+   
+   int nErr = 0;
+   
+   //The largest fractions of a mode's variance extrapolated beyond, and dropped above, the grid by wind rescaling, per condition
+   std::vector<realT> maxTail(conds.size(), 0);
+   std::vector<realT> maxTrunc(conds.size(), 0);
+   
+   auto t0 = std::chrono::steady_clock::now();
+   int nThreads = 1;
+   
+   #pragma omp parallel
+   {
+      #pragma omp single
+      nThreads = omp_get_num_threads();
+      
+      //Pin before allocating, so the copies below are first-touched on this thread's node
+      cpu_set_t prevCpus;
+      bool pinned = numaPin && numa.pinThread(omp_get_thread_num(), omp_get_num_threads(), &prevCpus) >= 0;
+      
+      std::vector<aosysT> lsys;
+      for(size_t c = 0; c < conds.size(); ++c) lsys.push_back(condSys[c].get());
+      
+      std::vector<realT> lfreq = freq;
+      std::vector<realT> psd, cpsd;
+      std::vector<std::vector<realT>> layerPSD(fmt.layers);
+      
+      #pragma omp for schedule(dynamic)
+      for(size_t k = 0; k < mn.size(); ++k)
+      {
+         //Each mode is read once for all conditions
+         bool readErr = false;
+         if(fmt.layers > 0)
+         {
+            for(int l = 0; l < fmt.layers; ++l)
+            {
+               if(readGridPSD(layerPSD[l], psdDir, mn[k][0], mn[k][1], fmt, l) < 0 || layerPSD[l].size() != lfreq.size()) readErr = true;
+            }
+         }
+         else if(readGridPSD(psd, psdDir, mn[k][0], mn[k][1], fmt) < 0 || psd.size() != lfreq.size()) readErr = true;
+         
+         if(readErr)
+         {
+            #pragma omp atomic
+            ++nErr;
+            
+            continue;
+         }
+         
+         for(size_t c = 0; c < conds.size(); ++c)
+         {
+            if(fmt.layers > 0)
+            {
+               //Weighted sum of the layers
+               psd.assign(lfreq.size(), 0);
+               for(int l = 0; l < fmt.layers; ++l)
+               {
+                  realT w = (conds[c].cn2.size() > 0) ? conds[c].cn2[l] : fmt.layerCn2[l];
+                  for(size_t i = 0; i < psd.size(); ++i) psd[i] += w*layerPSD[l][i];
+               }
+            }
+            
+            realT trunc;
+            realT tail = rescaleWindPSD(cpsd, trunc, lfreq, psd, conds[c].windScale);
+            for(size_t i = 0; i < cpsd.size(); ++i) cpsd[i] *= conds[c].psdScale;
+            
+            #pragma omp critical
+            {
+               maxTail[c] = std::max(maxTail[c], tail);
+               maxTrunc[c] = std::max(maxTrunc[c], trunc);
+            }
+            
+            for(size_t s = 0; s < mags.size(); ++s)
+            {
+               lsys[c].starMag(mags[s]);
+               analyzeModePSD(results[c][s][k], lsys[c], lfreq, cpsd, mn[k][0], mn[k][1], lpNc, delays, intTimes);
+            }
+         }
+      }
+      
+      //The master thread continues after the region, so it must not stay pinned
+      if(pinned) numa.unpinThread(prevCpus);
+   }
+   
+   reportScaling("analyzePSDGrid", mn.size(), nThreads, t0);
+   
+   if(nErr > 0)
+   {
+      std::cerr << "analyzePSDGrid: " << nErr << " modes could not be read from " << psdDir << "\n";
+      return -1;
+   }
+   
+   std::vector<int> orders;
+   for(size_t i = 0; i < lpNc.size(); ++i)
+   {
+      if(lpNc[i] > 1) orders.push_back(lpNc[i]);
+   }
+   
+   //With one order the columns are as before, with more each is labeled with its order
+   std::vector<std::string> lpLabels(std::max<size_t>(orders.size(), 1), "");
+   if(orders.size() > 1)
+   {
+      for(size_t o = 0; o < orders.size(); ++o) lpLabels[o] = mx::ioutils::convertToString(orders[o]);
+   }
+   
+   //Each (m,n) is a cosine and a sine mode with the same PSD.
+   std::cout << "#mag    var_si";
+   for(size_t o = 0; o < lpLabels.size(); ++o) std::cout << "      var_lp" << lpLabels[o];
+   std::cout << "\n";
+   for(size_t c = 0; c < conds.size(); ++c)
+   {
+      std::string dir = psdDir + "/" + conds[c].dir;
+      
+      if(conds.size() > 1) std::cout << "#" << conds[c].dir << "\n";
+      
+      if(maxTail[c] > 0.01)
+      {
+         std::cerr << "analyzePSDGrid: " << conds[c].dir << ": up to " << 100*maxTail[c] << "% of a mode's variance is extrapolated above the grid's maximum frequency.\n";
+      }
+      
+      if(maxTrunc[c] > 0.01)
+      {
+         std::cerr << "analyzePSDGrid: " << conds[c].dir << ": up to " << 100*maxTrunc[c] << "% of a mode's variance is moved above the grid's maximum frequency and dropped.\n";
+      }
+      
+      for(size_t d = 0; d < delays.size(); ++d)
+      {
+         std::string ddir = dir;
+         if(delayDirs)
+         {
+            ddir += "/delay_" + mx::ioutils::convertToString(delays[d]);
+            std::cout << "#deltaTau = " << delays[d] << "\n";
+         }
+         
+         for(size_t s = 0; s < mags.size(); ++s)
+         {
+            std::ofstream fout;
+            fout.open(ddir + "/modes_" + mx::ioutils::convertToString(mags[s]) + ".dat");
+            fout << "#m n tau_si gopt_si var_si";
+            for(size_t o = 0; o < lpLabels.size(); ++o) fout << " tau_lp" << lpLabels[o] << " gopt_lp" << lpLabels[o] << " var_lp" << lpLabels[o];
+            fout << "\n";
+               
+            realT sum_si = 0;
+            std::vector<realT> sum_lp(lpLabels.size(), 0);
+            for(size_t k=0; k < mn.size(); ++k)
+            {
+               modeResult & r = results[c][s][k][d];
+               fout << r.m << " " << r.n << " " << r.tau_si << " " << r.gopt_si << " " << r.var_si;
+               
+               sum_si += 2*r.var_si;
+               
+               if(orders.size() == 0) fout << " 0 0 0";
+               for(size_t o = 0; o < orders.size(); ++o)
+               {
+                  fout << " " << r.tau_lp[o] << " " << r.gopt_lp[o] << " " << r.var_lp[o];
+                  sum_lp[o] += 2*r.var_lp[o];
+               }
+               fout << "\n";
+            }
+            fout.close();
+               
+            std::vector<const modeResult *> mres(mn.size());
+            for(size_t k=0; k < mn.size(); ++k) mres[k] = &results[c][s][k][d];
+            writeModeMaps(ddir + "/maps_" + mx::ioutils::convertToString(mags[s]) + ".fits", mn, mres, orders);
+            
+            std::cout << mags[s] << "\t" << sum_si;
+            for(size_t o = 0; o < sum_lp.size(); ++o) std::cout << "\t" << sum_lp[o];
+            std::cout << "\n";
+         }
+      }
+   }
+   
+   return 0;
+}
+
+template<typename realT>
+void mxAOSystem_app<realT>::writeModeMaps( const std::string & fileName,
+                                           const std::vector<std::array<int,2>> & mn,
+                                           const std::vector<const modeResult *> & res,
+                                           const std::vector<int> & orders
+                                         )
+{
+   int mc = 0;
+   for(size_t k=0; k < mn.size(); ++k) mc = std::max(mc, std::max(abs(mn[k][0]), abs(mn[k][1])));
+   
+   long N = 2*mc + 1;
+   
+   std::vector<std::string> names = {"gopt_si", "var_si", "tau_si"};
+   for(size_t o = 0; o < orders.size(); ++o)
+   {
+      std::string ord = mx::ioutils::convertToString(orders[o]);
+      names.push_back("gopt_lp" + ord);
+      names.push_back("var_lp" + ord);
+      names.push_back("tau_lp" + ord);
+      names.push_back("var_si/var_lp" + ord);
+   }
+   
+   std::vector<realT> cube(N*N*names.size(), 0);
+   
+   for(size_t k=0; k < mn.size(); ++k)
+   {
+      const modeResult & r = *res[k];
+      
+      std::vector<realT> vals = {r.gopt_si, r.var_si, r.tau_si};
+      for(size_t o = 0; o < orders.size(); ++o)
+      {
+         vals.push_back(r.gopt_lp[o]);
+         vals.push_back(r.var_lp[o]);
+         vals.push_back(r.tau_lp[o]);
+         vals.push_back( (r.var_lp[o] > 0) ? r.var_si/r.var_lp[o] : 0);
+      }
+      
+      //Column-major, so the first index is m
+      size_t p0 = (mc + r.m) + (mc + r.n)*N;
+      size_t p1 = (mc - r.m) + (mc - r.n)*N;
+      for(size_t q = 0; q < vals.size(); ++q)
+      {
+         cube[q*N*N + p0] = vals[q];
+         cube[q*N*N + p1] = vals[q];
+      }
+   }
+   
+   writer.push( [fileName, N, names, cube = std::move(cube)]()
+                {
+                   fitsTileFile<realT> ff;
+                   if(ff.create(fileName, N, N, names.size()) < 0) return -1;
+                   
+                   for(size_t q = 0; q < names.size(); ++q)
+                   {
+                      if(ff.writeKey("PLANE" + mx::ioutils::convertToString(q), names[q], "") < 0) return -1;
+                   }
+                   
+                   if(ff.writeAll(cube.data()) < 0) return -1;
+                   
+                   return ff.close();
+                });
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::temporalPSDGridAnalyze()
+{
+   if(gridDir == "")
+   {
+      std::cerr << "temporalPSDGridAnalyze: You must set gridDir.\n";
+      return -1;
+   }
+   
+   if(subDir == "")
+   {
+      std::cerr << "temporalPSDGridAnalyze: You must set subDir.\n";
+      return -1;
+   }
+   
+   if(aosys.fit_mn_max() <= 0)
+   {
+      std::cerr << "temporalPSDGridAnalyze: You must set fit_mn_max to be > 0.\n";
+      return -1;
+   }
+      
+   int mnCon = aosys.D()/aosys.d_min()/2;
+   
+
+   std::vector<realT> mags;
+   
+   if(starMags.size() == 0)
+   {
+      mags = { aosys.starMag() };
+   }
+   else
+   {
+      mags = starMags;
+   }
+   
+   psdGridFormat fmt;
+   readGridFormat(fmt, gridDir);
+   
+   std::vector<gridCondition> conds;
+   
+   if(gridR0.size() > 0)
+   {
+      if(fmt.r_0 <= 0)
+      {
+         std::cerr << "temporalPSDGridAnalyze: the r_0 of the grid in " << gridDir << " is unknown, so it can not be rescaled to gridR0.\n";
+         return -1;
+      }
+      
+      for(size_t i = 0; i < gridR0.size(); ++i)
+      {
+         if(gridR0[i] <= 0)
+         {
+            std::cerr << "temporalPSDGridAnalyze: gridR0 must be > 0.\n";
+            return -1;
+         }
+         
+         conds.push_back({gridR0[i], pow(gridR0[i]/fmt.r_0, -5.0/3.0), 1, subDir + "/r0_" + mx::ioutils::convertToString(gridR0[i]), {}});
+      }
+   }
+   else if(fmt.normalized)
+   {
+      if(fmt.lam_0 <= 0 || aosys.atm.lam_0() <= 0)
+      {
+         std::cerr << "temporalPSDGridAnalyze: lam_0 must be > 0 to rescale a normalized grid.\n";
+         return -1;
+      }
+      
+      //Rescale to the configured r_0, which scales as lam^(6/5)
+      realT r0 = aosys.atm.r_0() * pow(fmt.lam_0/aosys.atm.lam_0(), 6.0/5.0);
+      conds.push_back({r0, pow(r0/fmt.r_0, -5.0/3.0), 1, subDir, {}});
+   }
+   else
+   {
+      //A grid which is not normalized is analyzed at the r_0 it was calculated for
+      conds.push_back({0, 1, 1, subDir, {}});
+   }
+   
+   //Each r_0 at each wind speed
+   if(gridWindScale.size() > 0)
+   {
+      std::vector<gridCondition> r0conds = conds;
+      conds.clear();
+      
+      for(size_t i = 0; i < r0conds.size(); ++i)
+      {
+         for(size_t w = 0; w < gridWindScale.size(); ++w)
+         {
+            if(gridWindScale[w] <= 0)
+            {
+               std::cerr << "temporalPSDGridAnalyze: gridWindScale must be > 0.\n";
+               return -1;
+            }
+            
+            gridCondition c = r0conds[i];
+            c.windScale = gridWindScale[w];
+            c.dir += "/wind_" + mx::ioutils::convertToString(gridWindScale[w]);
+            conds.push_back(c);
+         }
+      }
+   }
+   
+   //Each of the above for each Cn^2 profile
+   std::vector<std::vector<realT>> profiles;
+   std::vector<int> profileLines; //The line of each profile in gridCn2File, or 0 for gridCn2
+   if(gridCn2.size() > 0)
+   {
+      profiles.push_back(gridCn2);
+      profileLines.push_back(0);
+   }
+   
+   if(gridCn2File != "")
+   {
+      std::ifstream fin(gridCn2File);
+      if(!fin.good())
+      {
+         std::cerr << "temporalPSDGridAnalyze: error reading " << gridCn2File << "\n";
+         return -1;
+      }
+      
+      std::string line;
+      int lineNo = 0;
+      while(std::getline(fin, line))
+      {
+         ++lineNo;
+         
+         if(line.find('#') != std::string::npos) line.erase(line.find('#'));
+         for(size_t i=0; i < line.size(); ++i) if(line[i] == ',') line[i] = ' ';
+         
+         std::stringstream ss(line);
+         std::vector<realT> w;
+         realT val;
+         while(ss >> val) w.push_back(val);
+         
+         if(w.size() > 0)
+         {
+            profiles.push_back(w);
+            profileLines.push_back(lineNo);
+         }
+      }
+   }
+   
+   if(profiles.size() > 0)
+   {
+      if(fmt.layers == 0)
+      {
+         std::cerr << "temporalPSDGridAnalyze: the grid in " << gridDir << " is not layered, so it can not be reweighted with gridCn2.  Make it with gridLayers=true.\n";
+         return -1;
+      }
+      
+      for(size_t p = 0; p < profiles.size(); ++p)
+      {
+         std::string name = (profileLines[p] == 0) ? "gridCn2" : "line " + mx::ioutils::convertToString(profileLines[p]) + " of " + gridCn2File;
+         
+         if(profiles[p].size() != (size_t) fmt.layers)
+         {
+            std::cerr << "temporalPSDGridAnalyze: the Cn2 profile in " << name << " has " << profiles[p].size() << " weights, but the grid has " << fmt.layers << " layers.\n";
+            return -1;
+         }
+         
+         //The weights are fractions of the total Cn^2, so r_0 sets the overall strength
+         realT sum = 0;
+         for(size_t l = 0; l < profiles[p].size(); ++l)
+         {
+            if(profiles[p][l] < 0)
+            {
+               std::cerr << "temporalPSDGridAnalyze: the Cn2 profile in " << name << " has a negative weight.\n";
+               return -1;
+            }
+            sum += profiles[p][l];
+         }
+         
+         if(sum <= 0)
+         {
+            std::cerr << "temporalPSDGridAnalyze: the Cn2 profile in " << name << " has no weight.\n";
+            return -1;
+         }
+         
+         for(size_t l = 0; l < profiles[p].size(); ++l) profiles[p][l] /= sum;
+      }
+      
+      std::vector<gridCondition> baseConds = conds;
+      conds.clear();
+      
+      for(size_t p = 0; p < profiles.size(); ++p)
+      {
+         for(size_t i = 0; i < baseConds.size(); ++i)
+         {
+            gridCondition c = baseConds[i];
+            c.cn2 = profiles[p];
+            
+            //Each profile from the file gets a directory after subDir, named by its line
+            if(profileLines[p] > 0) c.dir = subDir + "/cn2_" + mx::ioutils::convertToString(profileLines[p]) + c.dir.substr(subDir.size());
+            
+            conds.push_back(c);
+         }
+      }
+   }
+   
+   std::vector<realT> delays = gridDelays;
+   if(delays.size() == 0) delays = { aosys.deltaTau() };
+   
+   for(size_t d = 0; d < delays.size(); ++d)
+   {
+      if(delays[d] < 0)
+      {
+         std::cerr << "temporalPSDGridAnalyze: gridDelays must be >= 0.\n";
+         return -1;
+      }
+   }
+   
+   //A double precision binv grid with none of the options above is analyzed by the library, as it always was
+   std::vector<int> orders;
+   for(size_t i = 0; i < lpNc.size(); ++i)
+   {
+      if(lpNc[i] > 1) orders.push_back(lpNc[i]);
+   }
+   
+   bool libraryGrid = (fmt.format == "binv" && fmt.precision == "double" && !fmt.normalized && fmt.layers == 0);
+   bool appOptions = (gridR0.size() > 0 || gridWindScale.size() > 0 || profiles.size() > 0 || gridDelays.size() > 0 || orders.size() > 1);
+   
+   if(libraryGrid && !appOptions)
+   {
+      mx::AO::analysis::fourierTemporalPSD<realT, aosysT> ftPSD;
+      aosysT lsys = sys.get();
+      ftPSD._aosys = &lsys;
+      
+      int nc = (orders.size() > 0) ? orders[0] : 0;
+      
+      //The controlled modes in the half-plane, for reportScaling
+      int mnMax = aosys.fit_mn_max();
+      size_t nModes = 0;
+      for(int m = 0; m <= std::min(mnMax, mnCon); ++m)
+      {
+         for(int n = -std::min(mnMax, mnCon); n <= std::min(mnMax, mnCon); ++n)
+         {
+            if(m == 0 && n <= 0) continue;
+            ++nModes;
+         }
+      }
+      
+      //The library's parallel loop runs on the threads of the OpenMP pool, so pinning the pool here places its workers.
+      //The library makes its own copies of the system and frequencies, so those are not node-local.
+      int nThreads = omp_get_max_threads();
+      std::vector<cpu_set_t> prevCpus(nThreads);
+      std::vector<char> pinned(nThreads, 0);
+      if(numaPin)
+      {
+         #pragma omp parallel num_threads(nThreads)
+         {
+            int t = omp_get_thread_num();
+            pinned[t] = (numa.pinThread(t, omp_get_num_threads(), &prevCpus[t]) >= 0);
+         }
+      }
+      
+      auto t0 = std::chrono::steady_clock::now();
+      
+      int rv = ftPSD.analyzePSDGrid( subDir, gridDir, aosys.fit_mn_max(), mnCon, nc, mags, intTimes);
+      
+      reportScaling("analyzePSDGrid", nModes, nThreads, t0);
+      
+      //The master thread continues after this, so it must not stay pinned
+      if(numaPin)
+      {
+         #pragma omp parallel num_threads(nThreads)
+         {
+            int t = omp_get_thread_num();
+            if(pinned[t]) numa.unpinThread(prevCpus[t]);
+         }
+      }
+      
+      return rv;
+   }
+   
+   return analyzePSDGrid( conds, gridDir, aosys.fit_mn_max(), mnCon, lpNc, delays, (gridDelays.size() > 0), mags, intTimes); 
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::surrogateSetup( perfSurrogate<realT> & sur )
+{
+   std::vector<std::string> names = {"r_0", "v_wind", "zeta", "lam_sci", "starMag"};
+   std::vector<const std::vector<realT> *> ranges = {&surR0, &surWind, &surZeta, &surLam, &surMag};
+   std::vector<realT> defs = {aosys.atm.r_0(), aosys.atm.v_wind(), aosys.zeta(), aosys.lam_sci(), aosys.starMag()};
+   
+   std::vector<std::vector<realT>> axes(names.size());
+   for(size_t a = 0; a < names.size(); ++a)
+   {
+      const std::vector<realT> & range = *ranges[a];
+      
+      if(range.size() == 0)
+      {
+         axes[a] = { defs[a] };
+         continue;
+      }
+      
+      if(range.size() != 3 || range[1] < range[0] || range[2] < 1 || (range[2] > 1 && range[1] == range[0]))
+      {
+         std::cerr << "surrogate: the " << names[a] << " axis must be min,max,N with min < max, or N = 1.\n";
+         return -1;
+      }
+      
+      int N = range[2];
+      for(int i=0; i < N; ++i) axes[a].push_back( range[0] + (range[1]-range[0])*( (N > 1) ? ((realT) i)/(N-1) : 0) );
+   }
+   
+   if(axes[0][0] <= 0 || axes[3][0] <= 0)
+   {
+      std::cerr << "surrogate: r_0 and lam_sci must be > 0.\n";
+      return -1;
+   }
+   
+   std::vector<std::string> outNames = {"Measurement", "Time-delay", "Fitting", "Chr-Scint-OPD", "Chr-Index", "Disp-Aniso-OPD", "NCP-error"};
+   
+   return sur.setup(names, axes, outNames, std::vector<char>(outNames.size(), 1));
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::surrogateExact( Eigen::Array<realT, -1, -1> & terms,
+                                           const realT * x,
+                                           const std::vector<realT> & mags
+                                         )
+{
+   aosysSnapshot<aosysT> pointSys = sys.derive( [&](aosysT & s)
+                                                {
+                                                   s.atm.r_0(x[0], s.atm.lam_0());
+                                                   s.atm.v_wind(x[1]);
+                                                   s.zeta(x[2]);
+                                                   s.lam_sci(x[3]);
+                                                });
+   
+   std::vector<realT> bestTau;
+   return errorBudgetBatch(terms, bestTau, pointSys, mags, tauWFSCandidates);
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::surrogate()
+{
+   typedef std::chrono::steady_clock clockT;
+   
+   if(surrogateFile == "")
+   {
+      std::cerr << "surrogate: You must set surrogateFile.\n";
+      return -1;
+   }
+   
+   perfSurrogate<realT> sur;
+   if(surrogateSetup(sur) < 0) return -1;
+   
+   size_t tableBytes = sur.nPoints()*sur.nOut()*sizeof(realT);
+   if(!budget.fits(tableBytes))
+   {
+      std::cerr << "surrogate: the table of " << sur.nPoints() << " points does not fit in the memory budget.\n";
+      return -1;
+   }
+   memoryLease lease(budget, tableBytes);
+   
+   const std::vector<realT> & mags = sur.axis(4);
+   size_t nMags = mags.size();
+   size_t nCond = sur.nPoints()/nMags; //The magnitude axis varies fastest
+   
+   int nThreads = omp_get_max_threads();
+   int err = 0;
+   
+   auto t0 = clockT::now();
+   
+   //With few conditions, the magnitudes of each are calculated in parallel by errorBudgetBatch instead
+   #pragma omp parallel for schedule(dynamic) if(nCond >= (size_t) nThreads)
+   for(size_t c = 0; c < nCond; ++c)
+   {
+      std::vector<realT> x;
+      sur.coords(x, c*nMags);
+      
+      Eigen::Array<realT, -1, -1> terms;
+      if(surrogateExact(terms, x.data(), mags) < 0)
+      {
+         #pragma omp atomic write
+         err = 1;
+         continue;
+      }
+      
+      for(size_t i=0; i < nMags; ++i) sur.set(c*nMags + i, terms.col(i).data());
+   }
+   
+   if(err) return -1;
+   
+   double tBuild = std::chrono::duration<double>(clockT::now() - t0).count();
+   
+   if(sur.save(surrogateFile) < 0) return -1;
+   
+   //Held-out points, uniform in the hypercube
+   int nCheck = std::max(surrogateCheck, 0);
+   std::vector<std::vector<realT>> pts(nCheck, std::vector<realT>(sur.nAxes()));
+   
+   std::mt19937_64 gen(1);
+   for(int k=0; k < nCheck; ++k)
+   {
+      for(size_t a=0; a < sur.nAxes(); ++a)
+      {
+         const std::vector<realT> & ax = sur.axis(a);
+         pts[k][a] = std::uniform_real_distribution<realT>(ax.front(), ax.back())(gen);
+      }
+   }
+   
+   Eigen::Array<realT, -1, -1> exact(ebNTerms, nCheck), approx(ebNTerms, nCheck);
+   
+   #pragma omp parallel for schedule(dynamic)
+   for(int k=0; k < nCheck; ++k)
+   {
+      Eigen::Array<realT, -1, -1> terms;
+      std::vector<realT> mag = { pts[k][4] };
+      
+      if(surrogateExact(terms, pts[k].data(), mag) < 0)
+      {
+         #pragma omp atomic write
+         err = 1;
+         continue;
+      }
+      exact.col(k) = terms.col(0);
+      
+      sur.query(approx.col(k).data(), pts[k].data());
+      approx(ebStrehl, k) = exp( -approx.col(k).head(ebStrehl).sum());
+   }
+   
+   if(err) return -1;
+   
+   //Time the queries on one thread
+   Eigen::Array<realT, -1, 1> out(ebNTerms);
+   int nQuery = 0;
+   realT qsum = 0; //Checked below, so the queries are not optimized away
+   auto tq = clockT::now();
+   for(int r=0; r < 1000 && nCheck > 0; ++r)
+   {
+      for(int k=0; k < nCheck; ++k)
+      {
+         sur.query(out.data(), pts[k].data());
+         qsum += out.sum();
+         ++nQuery;
+      }
+   }
+   double tQuery = (nQuery > 0) ? std::chrono::duration<double>(clockT::now() - tq).count()/nQuery : 0;
+   
+   if(!std::isfinite(qsum))
+   {
+      std::cerr << "surrogate: the table in " << surrogateFile << " gives non-finite values.\n";
+      return -1;
+   }
+   
+   std::cout << "surrogate: " << surrogateFile << "\n";
+   std::cout << "  grid points:         " << sur.nPoints() << "\n";
+   std::cout << "  build time:          " << tBuild << " s on " << nThreads << " threads\n";
+   std::cout << "  query time:          " << tQuery*1e9 << " ns\n";
+   std::cout << "  held-out points:     " << nCheck << "\n";
+   
+   if(nCheck > 0)
+   {
+      Eigen::Array<realT, -1, 1> dS = (approx.row(ebStrehl) - exact.row(ebStrehl)).abs().transpose();
+      std::cout << "  Strehl error:        max " << dS.maxCoeff() << ", rms " << sqrt(dS.square().mean()) << "\n";
+      
+      std::cout << "  max relative error of each variance:\n";
+      for(size_t o=0; o < sur.nOut(); ++o)
+      {
+         realT mx = 0;
+         for(int k=0; k < nCheck; ++k)
+         {
+            if(exact(o,k) > 0) mx = std::max(mx, fabs(approx(o,k)/exact(o,k) - 1));
+         }
+         std::cout << "    " << sur.outName(o) << ": " << mx << "\n";
+      }
+   }
+   
+   return 0;
+}
+
+template<typename realT>
+int mxAOSystem_app<realT>::surrogateQuery()
+{
+   if(surrogateFile == "")
+   {
+      std::cerr << "surrogateQuery: You must set surrogateFile.\n";
+      return -1;
+   }
+   
+   perfSurrogate<realT> sur;
+   if(sur.load(surrogateFile) < 0) return -1;
+   
+   int lamAxis = -1;
+   for(size_t a=0; a < sur.nAxes(); ++a) if(sur.axisName(a) == "lam_sci") lamAxis = a;
+   
+   std::cout << "#";
+   for(size_t a=0; a < sur.nAxes(); ++a) std::cout << " " << sur.axisName(a);
+   std::cout << " -> Strehl";
+   for(size_t o=0; o < sur.nOut(); ++o) std::cout << " " << sur.outName(o);
+   std::cout << " clamped" << std::endl;
+   
+   std::vector<realT> x(sur.nAxes()), out(sur.nOut());
+   std::string line;
+   while(std::getline(std::cin, line))
+   {
+      if(line.find_first_not_of(" \t") == std::string::npos || line[line.find_first_not_of(" \t")] == '#') continue;
+      
+      std::istringstream iss(line);
+      size_t a = 0;
+      while(a < x.size() && iss >> x[a]) ++a;
+      
+      if(a < x.size())
+      {
+         std::cout << "# error: expected " << x.size() << " values" << std::endl;
+         continue;
+      }
+      
+      int clamped = sur.query(out.data(), x.data());
+      
+      realT units = 1;
+      if(wfeUnits == "nm" && lamAxis >= 0) units = x[lamAxis] / (2.0*pi<realT>()) / 1e-9;
+      
+      realT tot = 0;
+      for(size_t o=0; o < out.size(); ++o) tot += out[o];
+      
+      std::cout << exp(-tot);
+      for(size_t o=0; o < out.size(); ++o) std::cout << " " << sqrt(out[o])*units;
+      std::cout << " " << clamped << std::endl;
+   }
+   
+   return 0;
 }
 
 int main(int argc, char ** argv)
@@ -0,0 +1,174 @@
+/** \file asyncWriter.hpp
+  * \brief A bounded queue of output jobs, run in order by a dedicated writer thread.
+  *
+  */
+
+#ifndef asyncWriter_hpp
+#define asyncWriter_hpp
+
+#include <iostream>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/// Runs output jobs (file writes) on a dedicated thread so that computation can continue.
+/** Jobs are run in the order they are pushed.  The queue is bounded: push blocks while maxQueue
+  * jobs are pending, so computation is throttled to the speed of the disk rather than buffering
+  * without limit.  With maxQueue = 0 jobs are run synchronously in push.
+  *
+  * A job must own the data it writes, e.g. by capturing it by value or by move.
+  */
+class asyncWriter
+{
+public:
+   typedef std::function<int()> jobT; ///< An output job, returns < 0 on error.
+
+protected:
+   size_t m_maxQueue {16};
+
+   std::deque<jobT> m_queue;
+   std::mutex m_mutex;
+   std::condition_variable m_notEmpty;
+   std::condition_variable m_notFull;
+
+   std::thread m_thread;
+   bool m_running {false};
+   bool m_stop {false};
+   size_t m_active {0};
+
+   size_t m_nFailed {0};
+
+   void run()
+   {
+      while(1)
+      {
+         jobT job;
+         {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_notEmpty.wait(lock, [this]{ return m_stop || m_queue.size() > 0; });
+
+            if(m_queue.size() == 0) return; //m_stop and nothing left to do
+
+            job = std::move(m_queue.front());
+            m_queue.pop_front();
+            ++m_active;
+         }
+         m_notFull.notify_one();
+
+         int rv = job();
+
+         {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            --m_active;
+            if(rv < 0) ++m_nFailed;
+         }
+         m_notFull.notify_all();
+      }
+   }
+
+   /// Start the writer thread if it is not running.  Must be called with m_mutex held.
+   void startThread()
+   {
+      if(m_running) return;
+
+      m_stop = false;
+      m_running = true;
+      m_thread = std::thread(&asyncWriter::run, this);
+   }
+
+public:
+
+   asyncWriter()
+   {
+   }
+
+   ~asyncWriter()
+   {
+      finish();
+   }
+
+   /// Set the maximum number of pending jobs.  Must be called before the first push.
+   void maxQueue( size_t mq )
+   {
+      m_maxQueue = mq;
+   }
+
+   /// Get the maximum number of pending jobs.
+   size_t maxQueue()
+   {
+      return m_maxQueue;
+   }
+
+   /// Start the writer thread now, rather than at the first push, so it does not inherit the affinity of a pinned worker.
+   void start()
+   {
+      if(m_maxQueue == 0) return;
+
+      std::lock_guard<std::mutex> lock(m_mutex);
+      startThread();
+   }
+
+   /// Add a job to the queue, blocking while the queue is full.
+   void push( jobT && job )
+   {
+      if(m_maxQueue == 0)
+      {
+         if(job() < 0)
+         {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            ++m_nFailed;
+         }
+         return;
+      }
+
+      {
+         std::unique_lock<std::mutex> lock(m_mutex);
+
+         startThread();
+
+         m_notFull.wait(lock, [this]{ return m_queue.size() < m_maxQueue; });
+
+         m_queue.push_back(std::move(job));
+      }
+      m_notEmpty.notify_one();
+   }
+
+   /// Wait until all pending jobs are complete.
+   void flush()
+   {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_notFull.wait(lock, [this]{ return m_queue.size() == 0 && m_active == 0; });
+   }
+
+   /// Complete all pending jobs and stop the writer thread.
+   /**
+     * \returns 0 if all jobs since the last finish succeeded
+     * \returns -1 if any job failed
+     */
+   int finish()
+   {
+      {
+         std::lock_guard<std::mutex> lock(m_mutex);
+         m_stop = true;
+      }
+      m_notEmpty.notify_all();
+
+      if(m_thread.joinable()) m_thread.join();
+
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_running = false;
+
+      if(m_nFailed > 0)
+      {
+         std::cerr << "asyncWriter: " << m_nFailed << " output jobs failed.\n";
+         m_nFailed = 0;
+         return -1;
+      }
+
+      return 0;
+   }
+};
+
+#endif //asyncWriter_hpp
@@ -0,0 +1,266 @@
+/** \file bandpass.hpp
+  * \brief Filter bandpasses, and adaptive integration over them.
+  *
+  */
+
+#ifndef bandpass_hpp
+#define bandpass_hpp
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cmath>
+
+#include <Eigen/Dense>
+
+#include <mx/ioutils/readColumns.hpp>
+
+#include "taskBudget.hpp"
+
+/// A filter transmission curve, either a top-hat or a piecewise linear table.
+template<typename realT>
+struct bandpass
+{
+   std::vector<realT> lam; ///< Wavelengths of the table [m], ascending.
+   std::vector<realT> trans; ///< Transmission at each wavelength.
+
+   /// Set a top-hat bandpass.
+   void tophat( realT lam0,  ///< [in] the central wavelength [m]
+                realT width  ///< [in] the full width [m]
+              )
+   {
+      lam = {lam0 - 0.5*width, lam0 + 0.5*width};
+      trans = {1, 1};
+   }
+
+   /// Load a table with columns wavelength [m] and transmission.
+   int load( const std::string & fileName )
+   {
+      lam.clear();
+      trans.clear();
+
+      if( mx::ioutils::readColumns(fileName, lam, trans) < 0)
+      {
+         std::cerr << "bandpass::load: error reading " << fileName << "\n";
+         return -1;
+      }
+
+      if(lam.size() < 2)
+      {
+         std::cerr << "bandpass::load: " << fileName << " must contain at least 2 wavelengths.\n";
+         return -1;
+      }
+
+      for(size_t i=1; i < lam.size(); ++i)
+      {
+         if(lam[i] <= lam[i-1])
+         {
+            std::cerr << "bandpass::load: wavelengths in " << fileName << " must be ascending.\n";
+            return -1;
+         }
+      }
+
+      return 0;
+   }
+
+   /// Check if a bandpass has been set.
+   bool active()
+   {
+      return lam.size() > 1;
+   }
+
+   realT lamMin()
+   {
+      return lam.front();
+   }
+
+   realT lamMax()
+   {
+      return lam.back();
+   }
+
+   /// The transmission at a wavelength, linearly interpolated, and 0 outside the table.
+   realT T( realT l )
+   {
+      if(l < lam.front() || l > lam.back()) return 0;
+
+      size_t i = std::upper_bound(lam.begin(), lam.end(), l) - lam.begin();
+      if(i == lam.size()) return trans.back();
+      if(i == 0) return trans.front();
+
+      realT x = (l - lam[i-1])/(lam[i]-lam[i-1]);
+
+      return (1-x)*trans[i-1] + x*trans[i];
+   }
+
+   /// The integral of the transmission [m], exact for the piecewise linear table.
+   realT area()
+   {
+      realT a = 0;
+      for(size_t i=1; i < lam.size(); ++i) a += 0.5*(trans[i]+trans[i-1])*(lam[i]-lam[i-1]);
+      return a;
+   }
+};
+
+/// Integrate a function of wavelength over a bandpass with adaptive Simpson quadrature.
+/** Calculates the transmission-weighted mean of eval over the bandpass.  The value can be any Eigen array, e.g. a map
+  * or a column of error terms, and an interval is converged when the maximum absolute error estimate over its elements is
+  * within tol times the maximum absolute value.  The table knots start as interval boundaries, since the transmission
+  * has kinks there.  Only the values of the intervals still being refined are kept, so the memory held is set by the
+  * widest level of refinement, not by the total number of evaluations.  If budget is given, the held values are charged
+  * to it.  The wavelengths needed at each level of refinement are evaluated in parallel, so eval must be thread safe.
+  *
+  * \returns 0 on success
+  * \returns -1 on error
+  */
+template<typename realT, typename valueT, typename evalT>
+int bandIntegrate( valueT & result,       ///< [out] the transmission weighted mean
+                   bandpass<realT> & bp,  ///< [in] the bandpass
+                   evalT && eval,         ///< [in] function with signature void(valueT & val, realT lam)
+                   realT tol,             ///< [in] relative tolerance
+                   int maxDepth,          ///< [in] maximum number of times an interval is halved
+                   memoryBudget * budget = nullptr, ///< [in] [optional] the budget the held values are charged to
+                   size_t valueBytes = 0            ///< [in] [optional] the size of one value [bytes]
+                 )
+{
+   if(!bp.active())
+   {
+      std::cerr << "bandIntegrate: bandpass not set.\n";
+      return -1;
+   }
+
+   realT area = bp.area();
+   if(area <= 0)
+   {
+      std::cerr << "bandIntegrate: bandpass has no transmission.\n";
+      return -1;
+   }
+
+   struct interval
+   {
+      realT a;
+      realT b;
+      int depth;
+   };
+
+   std::map<realT, valueT> vals; //the weighted integrand at each wavelength
+   size_t held = 0; //the bytes of vals charged to budget
+
+   auto simpson = [&](realT a, realT b)
+   {
+      return ((b-a)/6.0)*(vals[a] + 4*vals[0.5*(a+b)] + vals[b]);
+   };
+
+   std::vector<interval> active;
+   for(size_t i=1; i < bp.lam.size(); ++i) active.push_back({bp.lam[i-1], bp.lam[i], 0});
+
+   bool first = true;
+
+   while(active.size() > 0)
+   {
+      //Gather the wavelengths needed for this level
+      std::vector<realT> need;
+      for(size_t k=0; k < active.size(); ++k)
+      {
+         realT a = active[k].a;
+         realT b = active[k].b;
+         realT m = 0.5*(a+b);
+
+         std::vector<realT> pts = {a, 0.5*(a+m), m, 0.5*(m+b), b};
+         for(size_t p=0; p < pts.size(); ++p)
+         {
+            if(vals.count(pts[p]) == 0)
+            {
+               vals[pts[p]];
+               need.push_back(pts[p]);
+            }
+         }
+      }
+
+      //Charge the new values before they are made.  The caller may already hold part of the budget, so this can not block.
+      if(budget)
+      {
+         if(!budget->tryAcquire(need.size()*valueBytes))
+         {
+            std::cerr << "bandIntegrate: " << vals.size() + need.size() << " wavelengths do not fit in the memory budget.  Raise bandTol or lower bandMaxDepth.\n";
+            budget->release(held);
+            return -1;
+         }
+         held += need.size()*valueBytes;
+      }
+
+      std::vector<valueT> newVals(need.size());
+
+      #pragma omp parallel for schedule(dynamic)
+      for(size_t p = 0; p < need.size(); ++p)
+      {
+         eval(newVals[p], need[p]);
+         newVals[p] *= bp.T(need[p]);
+      }
+
+      for(size_t p=0; p < need.size(); ++p) vals[need[p]] = std::move(newVals[p]);
+
+      if(first)
+      {
+         result = vals.begin()->second;
+         result.setZero();
+         first = false;
+      }
+
+      std::vector<interval> next;
+      for(size_t k=0; k < active.size(); ++k)
+      {
+         realT a = active[k].a;
+         realT b = active[k].b;
+         realT m = 0.5*(a+b);
+
+         valueT S1 = simpson(a, b);
+         valueT S2 = simpson(a, m) + simpson(m, b);
+
+         realT err = (S2 - S1).abs().maxCoeff();
+         realT scale = S2.abs().maxCoeff();
+
+         if(err <= 15*tol*scale || active[k].depth >= maxDepth)
+         {
+            result += S2 + (S2 - S1)/15.0;
+         }
+         else
+         {
+            next.push_back({a, m, active[k].depth+1});
+            next.push_back({m, b, active[k].depth+1});
+         }
+      }
+
+      //Keep only the values the remaining intervals use, so converged intervals do not hold memory
+      std::map<realT, valueT> keep;
+      for(size_t k=0; k < next.size(); ++k)
+      {
+         realT pts[3] = {next[k].a, 0.5*(next[k].a + next[k].b), next[k].b};
+         for(int p=0; p < 3; ++p)
+         {
+            if(keep.count(pts[p]) > 0) continue;
+
+            auto it = vals.find(pts[p]);
+            if(it != vals.end()) keep[pts[p]] = std::move(it->second);
+         }
+      }
+      vals = std::move(keep);
+
+      if(budget)
+      {
+         budget->release(held - vals.size()*valueBytes);
+         held = vals.size()*valueBytes;
+      }
+
+      active = std::move(next);
+   }
+
+   result /= area;
+
+   if(budget) budget->release(held);
+
+   return 0;
+}
+
+#endif //bandpass_hpp
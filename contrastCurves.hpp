@@ -0,0 +1,138 @@
+/** \file contrastCurves.hpp
+  * \brief Azimuthal statistics of contrast maps in radial bins.
+  *
+  */
+
+#ifndef contrastCurves_hpp
+#define contrastCurves_hpp
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include <Eigen/Dense>
+
+/// A precomputed index of the pixels in each radial bin of an image.
+/** The pixel indices are stored bin-by-bin in one contiguous array, so that a map can be
+  * gathered into a contiguous buffer for each bin.  The mean is then a single vectorized Eigen reduction,
+  * while the median and percentiles sort each bin.
+  * The index only depends on the image geometry, so it is built once and reused for every map.
+  */
+template<typename realT>
+struct radialBinIndex
+{
+   std::vector<size_t> binStart; ///< Offset into pixIdx of the first pixel in each bin.  Has size nBins()+1.
+   std::vector<size_t> pixIdx; ///< Linear (column-major) pixel indices, sorted by bin.
+   std::vector<realT> binRadius; ///< The mean radius of the pixels in each bin [pixels].
+
+   /// Build the index.
+   /** Bins are centered on integer multiples of dr, so the first bin contains the pixel at the center.
+     */
+   void build( int rows,    ///< [in] the number of rows in the image
+               int cols,    ///< [in] the number of columns in the image
+               realT dr,    ///< [in] the bin width [pixels]
+               realT maxRad ///< [in] the maximum radius to include [pixels]. If <= 0, the largest circle inscribed in the image is used.
+             )
+   {
+      realT xc = 0.5*(rows-1);
+      realT yc = 0.5*(cols-1);
+
+      if(maxRad <= 0) maxRad = std::min(xc, yc);
+
+      size_t nBins = floor(maxRad/dr + 0.5) + 1;
+
+      std::vector<size_t> counts(nBins, 0);
+      std::vector<int> pixBin(rows*cols, -1);
+
+      binRadius.assign(nBins, 0);
+
+      for(int j=0; j< cols; ++j)
+      {
+         for(int i=0; i< rows; ++i)
+         {
+            realT r = sqrt( pow(i-xc,2) + pow(j-yc,2));
+
+            size_t b = floor(r/dr + 0.5);
+            if(b >= nBins) continue;
+
+            pixBin[j*rows + i] = b;
+            ++counts[b];
+            binRadius[b] += r;
+         }
+      }
+
+      binStart.resize(nBins+1);
+      binStart[0] = 0;
+      for(size_t b=0; b< nBins; ++b)
+      {
+         binStart[b+1] = binStart[b] + counts[b];
+         if(counts[b] > 0) binRadius[b] /= counts[b];
+      }
+
+      pixIdx.resize(binStart[nBins]);
+      std::vector<size_t> fill(binStart.begin(), binStart.end()-1);
+
+      for(size_t k=0; k < pixBin.size(); ++k)
+      {
+         if(pixBin[k] < 0) continue;
+         pixIdx[ fill[pixBin[k]]++ ] = k;
+      }
+   }
+
+   /// Get the number of bins
+   size_t nBins()
+   {
+      if(binStart.size() == 0) return 0;
+      return binStart.size()-1;
+   }
+
+   /// Calculate the azimuthal statistics of an image in each bin.
+   /** The output has one row per bin, with columns mean, median, and then the requested percentiles.
+     * The mean is one pass over the gathered bin.  The median and percentiles sort the bin, O(n log n) in its size,
+     * and use the nearest-rank on the sorted values.
+     */
+   template<typename imageT, typename curvesT>
+   void stats( curvesT & curves,                     ///< [out] the statistics, resized to nBins() x (2+percentiles.size())
+               const imageT & im,                    ///< [in] the image, must have the geometry used in build.
+               const std::vector<realT> & percentiles ///< [in] the percentiles to calculate, in [0,100].
+             )
+   {
+      curves.resize(nBins(), 2 + percentiles.size());
+
+      Eigen::Array<realT, -1, 1> buff;
+
+      for(size_t b=0; b< nBins(); ++b)
+      {
+         size_t nb = binStart[b+1] - binStart[b];
+
+         if(nb == 0)
+         {
+            curves.row(b).setZero();
+            continue;
+         }
+
+         //Gather into contiguous memory so the reduction vectorizes
+         buff.resize(nb);
+         const size_t * idx = pixIdx.data() + binStart[b];
+         for(size_t k=0; k< nb; ++k) buff(k) = im.data()[idx[k]];
+
+         curves(b,0) = buff.sum()/nb;
+
+         std::sort(buff.data(), buff.data()+nb);
+
+         if(nb % 2 == 1) curves(b,1) = buff(nb/2);
+         else curves(b,1) = 0.5*(buff(nb/2-1) + buff(nb/2));
+
+         for(size_t p=0; p < percentiles.size(); ++p)
+         {
+            long k = ceil(0.01*percentiles[p]*nb) - 1;
+            if(k < 0) k = 0;
+            if(k >= (long) nb) k = nb-1;
+
+            curves(b,2+p) = buff(k);
+         }
+      }
+   }
+};
+
+#endif //contrastCurves_hpp
@@ -0,0 +1,214 @@
+/** \file errorBudgetBatch.hpp
+  * \brief The error budget of a system for a batch of star magnitudes.
+  *
+  */
+
+#ifndef errorBudgetBatch_hpp
+#define errorBudgetBatch_hpp
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+#include <Eigen/Dense>
+
+#include "systemSnapshot.hpp"
+
+/// The rows of the array filled by errorBudgetBatch.
+enum errorBudgetTerm
+{
+   ebMeasurement,
+   ebTimeDelay,
+   ebFitting,
+   ebChromScintOPD,
+   ebChromIndex,
+   ebDispAnisoOPD,
+   ebNCP,
+   ebStrehl,
+   ebNTerms
+};
+
+/// Fix the WFS integration time of every mode of a system.
+/** By default the library optimizes the integration time of each mode, searching above minTauWFS.  This turns that
+  * off, so the errors are calculated at exactly tau.
+  */
+template<typename realT, typename aosysT>
+void fixTauWFS( aosysT & s, ///< [in/out] the system
+                realT tau   ///< [in] the integration time [s]
+              )
+{
+   s.optTau(false);
+   s.tauWFS(tau);
+}
+
+/// Calculate the error terms of one system which do not depend on the star magnitude or the WFS integration time.
+/** The fitting, chromatic, and NCP terms of terms are set, and the others are set to 0.
+  */
+template<typename realT, typename aosysT>
+void errorBudgetFixed( Eigen::Array<realT, -1, 1> & terms, ///< [out] the ebNTerms terms, of which only the fixed ones are set
+                       aosysT & s                          ///< [in] the configured system
+                     )
+{
+   terms.setZero(ebNTerms);
+
+   terms(ebFitting) = s.fittingError();
+   terms(ebChromScintOPD) = s.chromScintOPDError();
+   terms(ebChromIndex) = s.chromIndexError();
+   terms(ebDispAnisoOPD) = s.dispAnisoOPDError();
+   terms(ebNCP) = s.ncpError();
+}
+
+/// Calculate the measurement and time-delay errors of one system at one WFS integration time.
+/** If tau is > 0 it is fixed with fixTauWFS, which changes s.  Otherwise the configured integration time is used.
+  */
+template<typename realT, typename aosysT>
+void errorBudgetAtTau( realT & meas, ///< [out] the measurement error [rad^2]
+                       realT & td,   ///< [out] the time-delay error [rad^2]
+                       aosysT & s,   ///< [in] the configured system
+                       realT tau     ///< [in] the integration time [s], or 0 for the configured one
+                     )
+{
+   if(tau > 0) fixTauWFS(s, tau);
+
+   meas = s.measurementError();
+   td = s.timeDelayError();
+}
+
+/// Calculate every error term for a batch of star magnitudes, each at its optimal WFS integration time.
+/** Only the measurement and time-delay errors depend on the star magnitude and the WFS integration time, through the
+  * flux and the gains optimized for it, so only they are calculated for each pair, in parallel on systems derived from sys.
+  * Each pair is calculated with the integration time fixed by fixTauWFS, so the chosen time is the one used by every mode.
+  * The fitting, chromatic, and NCP errors are calculated once and shared by every magnitude and integration time.  For
+  * each magnitude the integration time with the smallest total is chosen, and the Strehl ratios of all magnitudes
+  * are then calculated in one vectorized expression.
+  *
+  * \returns 0 on success
+  * \returns -1 if an integration time is not positive
+  */
+template<typename realT, typename aosysT>
+int errorBudgetBatch( Eigen::Array<realT, -1, -1> & terms, ///< [out] ebNTerms x mags.size(), the variances [rad^2] and the Strehl ratio
+                      std::vector<realT> & bestTau,        ///< [out] the chosen integration time of each magnitude [s], or 0 if taus is empty
+                      const aosysSnapshot<aosysT> & sys,   ///< [in] the configured system
+                      const std::vector<realT> & mags,     ///< [in] the star magnitudes
+                      const std::vector<realT> & taus      ///< [in] the candidate integration times [s].  If empty, the configured minTauWFS is used.
+                    )
+{
+   int nMags = mags.size();
+   int nTaus = std::max<int>(taus.size(), 1);
+
+   for(size_t t = 0; t < taus.size(); ++t)
+   {
+      if(taus[t] <= 0)
+      {
+         std::cerr << "errorBudgetBatch: integration times must be > 0.\n";
+         return -1;
+      }
+   }
+
+   terms.resize(ebNTerms, nMags);
+
+   //Independent of the magnitude and integration time
+   Eigen::Array<realT, -1, 1> fixed;
+   sys.eval( [&fixed](aosysT & s){ errorBudgetFixed(fixed, s); } );
+
+   terms.colwise() = fixed;
+
+   //Dependent on the magnitude and integration time, for each pair
+   Eigen::Array<realT, -1, -1> meas(nTaus, nMags), td(nTaus, nMags);
+
+   #pragma omp parallel for schedule(dynamic)
+   for(int p = 0; p < nMags*nTaus; ++p)
+   {
+      int i = p / nTaus;
+      int t = p % nTaus;
+
+      aosysSnapshot<aosysT> pairSys = sys.derive( [&](aosysT & s)
+                                                  {
+                                                     s.starMag(mags[i]);
+                                                     if(taus.size() > 0) fixTauWFS(s, taus[t]);
+                                                  });
+
+      pairSys.eval( [&](aosysT & s){ errorBudgetAtTau(meas(t, i), td(t, i), s, (realT) 0); } );
+   }
+
+   //The best integration time of each magnitude
+   bestTau.assign(nMags, 0);
+   Eigen::Array<realT, -1, -1> total = meas + td;
+   for(int i = 0; i < nMags; ++i)
+   {
+      int t;
+      total.col(i).minCoeff(&t);
+
+      terms(ebMeasurement, i) = meas(t, i);
+      terms(ebTimeDelay, i) = td(t, i);
+      if(taus.size() > 0) bestTau[i] = taus[t];
+   }
+
+   terms.row(ebStrehl) = (-terms.topRows(ebStrehl).colwise().sum()).exp();
+
+   return 0;
+}
+
+/// Calculate every error term of one system, at the best of several WFS integration times.
+/** This is for callers which already hold a private copy of the system, e.g. one per thread, and change its parameters
+  * between calls.  The integration times are fixed with fixTauWFS, and the configured integration time settings of s
+  * are restored before returning.
+  *
+  * \returns the chosen integration time [s], or 0 if taus is empty
+  */
+template<typename realT, typename aosysT>
+realT errorBudgetTerms( Eigen::Array<realT, -1, 1> & terms, ///< [out] the ebNTerms variances [rad^2] and the Strehl ratio
+                        aosysT & s,                         ///< [in] the configured system
+                        const std::vector<realT> & taus     ///< [in] the candidate integration times [s], all > 0.  If empty, the configured minTauWFS is used.
+                      )
+{
+   errorBudgetFixed(terms, s);
+
+   realT best = 0;
+   if(taus.size() == 0)
+   {
+      errorBudgetAtTau(terms(ebMeasurement), terms(ebTimeDelay), s, (realT) 0);
+   }
+   else
+   {
+      bool optTau0 = s.optTau();
+      realT tau0 = s.tauWFS();
+      realT bestTotal = std::numeric_limits<realT>::max();
+
+      for(size_t t = 0; t < taus.size(); ++t)
+      {
+         realT meas, td;
+         errorBudgetAtTau(meas, td, s, taus[t]);
+
+         if(meas + td < bestTotal)
+         {
+            bestTotal = meas + td;
+            terms(ebMeasurement) = meas;
+            terms(ebTimeDelay) = td;
+            best = taus[t];
+         }
+      }
+
+      s.optTau(optTau0);
+      s.tauWFS(tau0);
+   }
+
+   terms(ebStrehl) = exp( -terms.head(ebStrehl).sum());
+
+   return best;
+}
+
+/// Calculate every error term for a batch of star magnitudes, at the configured WFS integration time.
+template<typename realT, typename aosysT>
+int errorBudgetBatch( Eigen::Array<realT, -1, -1> & terms, ///< [out] ebNTerms x mags.size(), the variances [rad^2] and the Strehl ratio
+                      const aosysSnapshot<aosysT> & sys,   ///< [in] the configured system
+                      const std::vector<realT> & mags      ///< [in] the star magnitudes
+                    )
+{
+   std::vector<realT> bestTau;
+   return errorBudgetBatch(terms, bestTau, sys, mags, std::vector<realT>());
+}
+
+#endif //errorBudgetBatch_hpp
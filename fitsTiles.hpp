@@ -0,0 +1,248 @@
+/** \file fitsTiles.hpp
+  * \brief Reading and writing FITS images one rectangular tile at a time, with optional compression.
+  *
+  */
+
+#ifndef fitsTiles_hpp
+#define fitsTiles_hpp
+
+#include <iostream>
+#include <string>
+#include <type_traits>
+
+#include <fitsio.h>
+
+#include <mx/improc/fitsFile.hpp>
+
+/// A FITS image on disk which is read or written in tiles, so the whole image is never in memory.
+/** Tiles are Eigen-like column-major arrays, and the image rows correspond to the first FITS axis,
+  * matching mx::improc::fitsFile.
+  *
+  * New images can be tile-compressed by cfitsio.  Floating point data is compressed losslessly with gzip or gzip2,
+  * or is quantized first.  A positive quantize level q sets the quantization step to the estimated noise / q, and
+  * a negative level sets the step to |q| in data units, so the error is at most |q|/2.  Rice requires quantization
+  * for floating point data.  Compressed files are read transparently by cfitsio, including by mx::improc::fitsFile.
+  */
+template<typename dataT>
+class fitsTileFile
+{
+protected:
+   fitsfile * m_fptr {nullptr};
+   std::string m_fileName;
+
+   long m_rows {0};
+   long m_cols {0};
+   long m_planes {1};
+
+   std::string m_compress {"none"};
+   float m_quantize {0};
+
+   int report( const std::string & func,
+               int fstatus
+             )
+   {
+      char emsg[FLEN_STATUS];
+      fits_get_errstatus(fstatus, emsg);
+      std::cerr << "fitsTileFile::" << func << ": " << m_fileName << ": " << emsg << "\n";
+      return -1;
+   }
+
+public:
+
+   ~fitsTileFile()
+   {
+      close();
+   }
+
+   /// Set the compression used for new images.
+   /**
+     * \returns 0 on success
+     * \returns -1 if the type is unknown, or if rice is requested for floating point data without quantization.
+     */
+   int compression( const std::string & type, ///< [in] none, rice, gzip, or gzip2
+                    float quantize            ///< [in] the quantize level, 0 for lossless.
+                  )
+   {
+      if(type != "none" && type != "rice" && type != "gzip" && type != "gzip2")
+      {
+         std::cerr << "fitsTileFile::compression: unknown compression type " << type << "\n";
+         return -1;
+      }
+
+      if(type == "rice" && quantize == 0 && !std::is_integral<dataT>::value)
+      {
+         std::cerr << "fitsTileFile::compression: rice requires a non-zero quantize level for floating point data.  Use gzip for lossless compression.\n";
+         return -1;
+      }
+
+      m_compress = type;
+      m_quantize = quantize;
+
+      return 0;
+   }
+
+   /// Create a new image, or a cube if planes > 1, overwriting any existing file.
+   /** If the image is compressed and tileRows and tileCols are > 0, the compression tiles are that size, so that
+     * writeTile with tiles of the same size on the same grid compresses each tile once.  Otherwise cfitsio compresses
+     * whole rows, and a tile which does not span the rows is decompressed and recompressed on every write.
+     */
+   int create( const std::string & fileName,
+               long rows,
+               long cols,
+               long planes = 1,
+               long tileRows = 0, ///< [in] the rows of each compression tile, 0 for the cfitsio default
+               long tileCols = 0  ///< [in] the columns of each compression tile, 0 for the cfitsio default
+             )
+   {
+      close();
+
+      m_fileName = fileName;
+      m_rows = rows;
+      m_cols = cols;
+      m_planes = planes;
+
+      int fstatus = 0;
+      fits_create_file(&m_fptr, ("!" + fileName).c_str(), &fstatus);
+      if(fstatus) return report("create", fstatus);
+
+      if(m_compress != "none")
+      {
+         int ctype = RICE_1;
+         if(m_compress == "gzip") ctype = GZIP_1;
+         else if(m_compress == "gzip2") ctype = GZIP_2;
+
+         fits_set_compression_type(m_fptr, ctype, &fstatus);
+
+         if(tileRows > 0 && tileCols > 0)
+         {
+            long tdim[3] = {tileRows, tileCols, 1};
+            fits_set_tile_dim(m_fptr, (planes > 1) ? 3 : 2, tdim, &fstatus);
+         }
+
+         if(!std::is_integral<dataT>::value)
+         {
+            fits_set_quantize_level(m_fptr, m_quantize, &fstatus);
+            if(m_quantize != 0) fits_set_quantize_method(m_fptr, SUBTRACTIVE_DITHER_1, &fstatus);
+         }
+
+         if(fstatus) return report("create", fstatus);
+      }
+
+      long naxes[3] = {rows, cols, planes};
+      fits_create_img(m_fptr, mx::improc::getFitsBITPIX<dataT>(), (planes > 1) ? 3 : 2, naxes, &fstatus);
+      if(fstatus) return report("create", fstatus);
+
+      return 0;
+   }
+
+   /// Open an existing image for reading.
+   int open( const std::string & fileName )
+   {
+      close();
+
+      m_fileName = fileName;
+
+      int fstatus = 0;
+      fits_open_file(&m_fptr, fileName.c_str(), READONLY, &fstatus);
+      if(fstatus) return report("open", fstatus);
+
+      long naxes[2] = {0, 1};
+      fits_get_img_size(m_fptr, 2, naxes, &fstatus);
+      if(fstatus) return report("open", fstatus);
+
+      m_rows = naxes[0];
+      m_cols = naxes[1];
+
+      return 0;
+   }
+
+   /// Close the file, flushing any buffered tiles.
+   int close()
+   {
+      if(m_fptr == nullptr) return 0;
+
+      int fstatus = 0;
+      fits_close_file(m_fptr, &fstatus);
+      m_fptr = nullptr;
+
+      if(fstatus) return report("close", fstatus);
+
+      return 0;
+   }
+
+   long rows() { return m_rows; }
+
+   long cols() { return m_cols; }
+
+   /// Write a tile with its first pixel at (i0, j0).
+   template<typename tileT>
+   int writeTile( tileT & tile,
+                  long i0,
+                  long j0
+                )
+   {
+      long fpix[2] = {i0+1, j0+1};
+      long lpix[2] = {i0 + (long) tile.rows(), j0 + (long) tile.cols()};
+
+      int fstatus = 0;
+      fits_write_subset(m_fptr, mx::improc::getFitsType<dataT>(), fpix, lpix, tile.data(), &fstatus);
+      if(fstatus) return report("writeTile", fstatus);
+
+      return 0;
+   }
+
+   /// Write a string keyword to the header of a new image.
+   int writeKey( const std::string & key,
+                 const std::string & value,
+                 const std::string & comment
+               )
+   {
+      int fstatus = 0;
+      fits_update_key(m_fptr, TSTRING, key.c_str(), (void *) value.c_str(), comment.c_str(), &fstatus);
+      if(fstatus) return report("writeKey", fstatus);
+
+      return 0;
+   }
+
+   /// Write every pixel of a new image or cube in one call, from column-major data.
+   int writeAll( const dataT * data )
+   {
+      int fstatus = 0;
+      fits_write_img(m_fptr, mx::improc::getFitsType<dataT>(), 1, m_rows*m_cols*m_planes, (void *) data, &fstatus);
+      if(fstatus) return report("writeAll", fstatus);
+
+      return 0;
+   }
+
+   /// Write a whole image to a new file.
+   template<typename imageT>
+   int writeImage( const std::string & fileName,
+                   imageT & im
+                 )
+   {
+      if(create(fileName, im.rows(), im.cols()) < 0) return -1;
+      if(writeTile(im, 0, 0) < 0) return -1;
+      return close();
+   }
+
+   /// Read a tile with its first pixel at (i0, j0). The tile must already be sized.
+   template<typename tileT>
+   int readTile( tileT & tile,
+                 long i0,
+                 long j0
+               )
+   {
+      long fpix[2] = {i0+1, j0+1};
+      long lpix[2] = {i0 + (long) tile.rows(), j0 + (long) tile.cols()};
+      long inc[2] = {1,1};
+      int anynul;
+
+      int fstatus = 0;
+      fits_read_subset(m_fptr, mx::improc::getFitsType<dataT>(), fpix, lpix, inc, nullptr, tile.data(), &anynul, &fstatus);
+      if(fstatus) return report("readTile", fstatus);
+
+      return 0;
+   }
+};
+
+#endif //fitsTiles_hpp
@@ -0,0 +1,164 @@
+/** \file numaPlacement.hpp
+  * \brief Pinning worker threads to the cores of NUMA nodes.
+  *
+  */
+
+#ifndef numaPlacement_hpp
+#define numaPlacement_hpp
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sched.h>
+
+/// The cores of each NUMA node, restricted to those this process may run on.
+/** The topology is read from /sys/devices/system/node, so no NUMA library is needed.  If that is not
+  * available the machine is treated as a single node.
+  */
+struct numaTopology
+{
+   std::vector<std::vector<int>> nodeCpus; ///< The allowed cpus of each node with at least one.
+
+   /// Parse a sysfs cpu list, e.g. "0-63,128-191".
+   static void parseCpuList( std::vector<int> & cpus,
+                             const std::string & list
+                           )
+   {
+      cpus.clear();
+
+      std::stringstream ss(list);
+      std::string range;
+      while(std::getline(ss, range, ','))
+      {
+         if(range.find_first_of("0123456789") == std::string::npos) continue;
+
+         int a, b;
+         size_t dash = range.find('-');
+         a = std::stoi(range.substr(0, dash));
+         b = (dash == std::string::npos) ? a : std::stoi(range.substr(dash+1));
+
+         for(int c = a; c <= b; ++c) cpus.push_back(c);
+      }
+   }
+
+   /// Load the topology of this machine.
+   /**
+     * \returns 0 on success
+     * \returns -1 if the allowed cpus could not be determined
+     */
+   int load()
+   {
+      nodeCpus.clear();
+
+      cpu_set_t allowed;
+      CPU_ZERO(&allowed);
+      if(sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+      {
+         std::cerr << "numaTopology::load: error getting cpu affinity\n";
+         return -1;
+      }
+
+      for(int node = 0; ; ++node)
+      {
+         std::ifstream fin("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+         if(!fin.good()) break;
+
+         std::string list;
+         std::getline(fin, list);
+
+         std::vector<int> cpus, use;
+         parseCpuList(cpus, list);
+
+         for(size_t i=0; i < cpus.size(); ++i)
+         {
+            if(cpus[i] < CPU_SETSIZE && CPU_ISSET(cpus[i], &allowed)) use.push_back(cpus[i]);
+         }
+
+         if(use.size() > 0) nodeCpus.push_back(use);
+      }
+
+      if(nodeCpus.size() == 0)
+      {
+         std::vector<int> use;
+         for(int c = 0; c < CPU_SETSIZE; ++c)
+         {
+            if(CPU_ISSET(c, &allowed)) use.push_back(c);
+         }
+         nodeCpus.push_back(use);
+      }
+
+      return 0;
+   }
+
+   size_t nNodes()
+   {
+      return nodeCpus.size();
+   }
+
+   /// Pin the calling thread to a core, spreading nThreads threads evenly over the nodes.
+   /** Threads are assigned to nodes in contiguous blocks, so neighbouring threads share a node, and
+     * round-robin over the cores of their node.
+     *
+     * The previous affinity is saved in prev, if not null, so it can be restored with unpinThread when the thread
+     * leaves the pinned region.
+     *
+     * \returns the node of the thread
+     * \returns -1 on error
+     */
+   int pinThread( int thread,              ///< [in] the index of the calling thread
+                  int nThreads,            ///< [in] the number of threads being placed
+                  cpu_set_t * prev = nullptr ///< [out] [optional] the affinity of the thread before pinning
+                )
+   {
+      if(nodeCpus.size() == 0 || nThreads < 1) return -1;
+
+      if(prev)
+      {
+         CPU_ZERO(prev);
+         if(sched_getaffinity(0, sizeof(cpu_set_t), prev) < 0)
+         {
+            std::cerr << "numaTopology::pinThread: error getting the affinity of thread " << thread << "\n";
+            return -1;
+         }
+      }
+
+      int node = ((size_t) thread * nodeCpus.size()) / nThreads;
+
+      //This thread's index within its node
+      int first = (node * nThreads + nodeCpus.size() - 1) / nodeCpus.size();
+      int cpu = nodeCpus[node][ (thread - first) % nodeCpus[node].size() ];
+
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+
+      if(sched_setaffinity(0, sizeof(set), &set) < 0)
+      {
+         std::cerr << "numaTopology::pinThread: error pinning thread " << thread << " to cpu " << cpu << "\n";
+         return -1;
+      }
+
+      return node;
+   }
+
+   /// Restore the affinity of the calling thread saved by pinThread.
+   /**
+     * \returns 0 on success
+     * \returns -1 on error
+     */
+   int unpinThread( const cpu_set_t & prev /**< [in] the affinity saved by pinThread */ )
+   {
+      if(sched_setaffinity(0, sizeof(cpu_set_t), &prev) < 0)
+      {
+         std::cerr << "numaTopology::unpinThread: error restoring the cpu affinity\n";
+         return -1;
+      }
+
+      return 0;
+   }
+};
+
+#endif //numaPlacement_hpp
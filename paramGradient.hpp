@@ -0,0 +1,162 @@
+/** \file paramGradient.hpp
+  * \brief Derivatives of system outputs with respect to its parameters, from one parallel pass over derived snapshots.
+  *
+  */
+
+#ifndef paramGradient_hpp
+#define paramGradient_hpp
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cmath>
+
+#include <Eigen/Dense>
+
+#include "systemSnapshot.hpp"
+
+/// A parameter of the AO system which can be differentiated.
+template<typename realT, typename aosysT>
+struct sysParam
+{
+   std::string name;
+   realT (*get)(aosysT &);
+   void (*set)(aosysT &, realT);
+   bool nonNeg; ///< If true, the parameter can not be negative, so it is differenced forward from 0.
+};
+
+/// Look up a parameter by its config name.
+/**
+  * \returns 0 on success
+  * \returns -1 if the name is not a parameter which can be differentiated
+  */
+template<typename realT, typename aosysT>
+int findSysParam( sysParam<realT, aosysT> & par,
+                  const std::string & name
+                )
+{
+   static const std::vector<sysParam<realT, aosysT>> params = {
+      {"D",         [](aosysT & s){ return (realT) s.D(); },          [](aosysT & s, realT v){ s.D(v); },                       true},
+      {"d_min",     [](aosysT & s){ return (realT) s.d_min(); },      [](aosysT & s, realT v){ s.d_min(v); },                   true},
+      {"r_0",       [](aosysT & s){ return (realT) s.atm.r_0(); },    [](aosysT & s, realT v){ s.atm.r_0(v, s.atm.lam_0()); },  true},
+      {"L_0",       [](aosysT & s){ return (realT) s.atm.L_0(); },    [](aosysT & s, realT v){ s.atm.L_0(v); },                 true},
+      {"v_wind",    [](aosysT & s){ return (realT) s.atm.v_wind(); }, [](aosysT & s, realT v){ s.atm.v_wind(v); },              true},
+      {"F0",        [](aosysT & s){ return (realT) s.F0(); },         [](aosysT & s, realT v){ s.F0(v); },                      true},
+      {"lam_wfs",   [](aosysT & s){ return (realT) s.lam_wfs(); },    [](aosysT & s, realT v){ s.lam_wfs(v); },                 true},
+      {"ron_wfs",   [](aosysT & s){ return (realT) s.ron_wfs(); },    [](aosysT & s, realT v){ s.ron_wfs(v); },                 true},
+      {"Fbg",       [](aosysT & s){ return (realT) s.Fbg(); },        [](aosysT & s, realT v){ s.Fbg(v); },                     true},
+      {"minTauWFS", [](aosysT & s){ return (realT) s.minTauWFS(); },  [](aosysT & s, realT v){ s.minTauWFS(v); },               true},
+      {"deltaTau",  [](aosysT & s){ return (realT) s.deltaTau(); },   [](aosysT & s, realT v){ s.deltaTau(v); },                true},
+      {"lam_sci",   [](aosysT & s){ return (realT) s.lam_sci(); },    [](aosysT & s, realT v){ s.lam_sci(v); },                 true},
+      {"zeta",      [](aosysT & s){ return (realT) s.zeta(); },       [](aosysT & s, realT v){ s.zeta(v); },                    true},
+      {"ncp_wfe",   [](aosysT & s){ return (realT) s.ncp_wfe(); },    [](aosysT & s, realT v){ s.ncp_wfe(v); },                 true},
+      {"ncp_alpha", [](aosysT & s){ return (realT) s.ncp_alpha(); },  [](aosysT & s, realT v){ s.ncp_alpha(v); },               false},
+      {"starMag",   [](aosysT & s){ return (realT) s.starMag(); },    [](aosysT & s, realT v){ s.starMag(v); },                 false}
+   };
+
+   for(size_t i = 0; i < params.size(); ++i)
+   {
+      if(params[i].name == name)
+      {
+         par = params[i];
+         return 0;
+      }
+   }
+
+   std::cerr << "findSysParam: " << name << " can not be differentiated.\n";
+   return -1;
+}
+
+/// Get the offsets and weights of a finite difference stencil for the first derivative at p0.
+/** The stencil is the 4th order central difference, with step relStep*|p0|.  If the parameter can not be negative
+  * and the stencil would cross 0, the 2nd order forward difference is used.  If p0 is 0 the step is relStep.
+  */
+template<typename realT>
+void diffStencil( std::vector<realT> & offsets, ///< [out] the offsets from p0
+                  std::vector<realT> & weights, ///< [out] the weight of each offset
+                  realT p0,                     ///< [in] the value of the parameter
+                  realT relStep,                ///< [in] the step relative to p0
+                  bool nonNeg                   ///< [in] whether the parameter can be negative
+                )
+{
+   realT h = (p0 == 0) ? relStep : relStep*fabs(p0);
+
+   if(nonNeg && p0 - 2*h < 0)
+   {
+      offsets = {0, h, 2*h};
+      weights = {-3/(2*h), 4/(2*h), -1/(2*h)};
+   }
+   else
+   {
+      offsets = {-2*h, -h, h, 2*h};
+      weights = {1/(12*h), -8/(12*h), 8/(12*h), -1/(12*h)};
+   }
+}
+
+/// Differentiate a vector output of the system with respect to several parameters, in one parallel pass.
+/** Every stencil point of every parameter is a snapshot derived from sys, and all are evaluated in parallel.  The
+  * output function is called with each snapshot, so it can use errorBudgetBatch and the other snapshot functions.
+  *
+  * \returns 0 on success
+  * \returns -1 if the output function fails, or its size differs between points
+  */
+template<typename realT, typename aosysT, typename funcT>
+int paramGradient( Eigen::Array<realT, -1, -1> & grad,                 ///< [out] the derivative of each output (rows) by each parameter (cols)
+                   const aosysSnapshot<aosysT> & sys,                  ///< [in] the system at which to differentiate
+                   const std::vector<sysParam<realT, aosysT>> & params, ///< [in] the parameters
+                   realT relStep,                                      ///< [in] the step relative to each parameter's value
+                   funcT && func                                       ///< [in] function with signature int(Eigen::Array<realT,-1,1> & out, const aosysSnapshot<aosysT> &)
+                 )
+{
+   //The stencil of each parameter, flattened
+   std::vector<int> pIdx;
+   std::vector<realT> offs, wts;
+   for(size_t p = 0; p < params.size(); ++p)
+   {
+      std::vector<realT> o, w;
+      realT p0 = sys.eval( [&](aosysT & s){ return params[p].get(s); } );
+      diffStencil(o, w, p0, relStep, params[p].nonNeg);
+
+      for(size_t k = 0; k < o.size(); ++k)
+      {
+         pIdx.push_back(p);
+         offs.push_back(p0 + o[k]);
+         wts.push_back(w[k]);
+      }
+   }
+
+   std::vector<Eigen::Array<realT, -1, 1>> outs(pIdx.size());
+   int err = 0;
+
+   #pragma omp parallel for schedule(dynamic)
+   for(size_t j = 0; j < pIdx.size(); ++j)
+   {
+      const sysParam<realT, aosysT> & par = params[pIdx[j]];
+      realT v = offs[j];
+
+      aosysSnapshot<aosysT> pointSys = sys.derive( [&](aosysT & s){ par.set(s, v); } );
+
+      if(func(outs[j], pointSys) < 0)
+      {
+         #pragma omp atomic write
+         err = 1;
+      }
+   }
+
+   if(err) return -1;
+
+   grad.setZero( (outs.size() > 0) ? outs[0].size() : 0, params.size());
+   for(size_t j = 0; j < outs.size(); ++j)
+   {
+      if(outs[j].size() != grad.rows())
+      {
+         std::cerr << "paramGradient: the output size changed between stencil points\n";
+         return -1;
+      }
+      grad.col(pIdx[j]) += wts[j]*outs[j];
+   }
+
+   return 0;
+}
+
+#endif //paramGradient_hpp
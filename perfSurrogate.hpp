@@ -0,0 +1,342 @@
+/** \file perfSurrogate.hpp
+  * \brief A precomputed table of system performance over a parameter hypercube, with fast multilinear interpolation.
+  *
+  */
+
+#ifndef perfSurrogate_hpp
+#define perfSurrogate_hpp
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "snapshotIO.hpp"
+
+#define SURROGATE_MAGIC "mxAOSurr"
+#define SURROGATE_VERSION 1
+
+/// A table of outputs sampled on a rectilinear grid of parameters, interpolated multilinearly.
+/** Each axis is a sorted list of parameter values, and an axis with a single value is held fixed.  The table
+  * holds the outputs at every grid point, with the last axis varying fastest.  Outputs which vary by orders of
+  * magnitude, like error variances, can be stored as their logarithm so they are interpolated in log space.
+  *
+  * The table is saved in the format of snapshotWriter, with its own magic string, and the values are aligned so a
+  * loaded table is used in place from the memory-mapped file.  A query only searches the axes and sums the corners
+  * of one grid cell, with no allocation, so it is safe to make from many threads at once.
+  */
+template<typename realT>
+class perfSurrogate
+{
+public:
+   static constexpr int maxAxes = 8; ///< The maximum number of axes.
+
+protected:
+   std::vector<std::string> m_axisNames;
+   std::vector<std::vector<realT>> m_axes;
+   std::vector<std::string> m_outNames;
+   std::vector<char> m_logOut; ///< For each output, whether it is stored as its logarithm.
+
+   std::vector<size_t> m_stride; ///< The stride of each axis, in grid points.
+
+   std::vector<realT> m_own; ///< The values of a table built in memory.
+   const realT * m_table {nullptr}; ///< The values, either m_own or in the mapped file.
+   std::unique_ptr<snapshotReader> m_map; ///< The mapping of a loaded table.
+
+   void setStrides()
+   {
+      m_stride.assign(m_axes.size(), 1);
+      for(int a = (int) m_axes.size() - 2; a >= 0; --a) m_stride[a] = m_stride[a+1]*m_axes[a+1].size();
+   }
+
+public:
+
+   /// Set up an empty table to be filled with set.
+   /**
+     * \returns 0 on success
+     * \returns -1 on an invalid axis
+     */
+   int setup( const std::vector<std::string> & axisNames,   ///< [in] the name of each axis
+              const std::vector<std::vector<realT>> & axes, ///< [in] the sorted values of each axis
+              const std::vector<std::string> & outNames,    ///< [in] the name of each output
+              const std::vector<char> & logOut              ///< [in] whether each output is interpolated in log space
+            )
+   {
+      if(axes.size() == 0 || axes.size() > (size_t) maxAxes || axisNames.size() != axes.size() || logOut.size() != outNames.size())
+      {
+         std::cerr << "perfSurrogate::setup: invalid axes or outputs\n";
+         return -1;
+      }
+
+      for(size_t a = 0; a < axes.size(); ++a)
+      {
+         if(axes[a].size() == 0 || !std::is_sorted(axes[a].begin(), axes[a].end()) ||
+                                    std::adjacent_find(axes[a].begin(), axes[a].end()) != axes[a].end())
+         {
+            std::cerr << "perfSurrogate::setup: axis " << axisNames[a] << " must be strictly increasing\n";
+            return -1;
+         }
+      }
+
+      m_axisNames = axisNames;
+      m_axes = axes;
+      m_outNames = outNames;
+      m_logOut = logOut;
+      setStrides();
+
+      m_map.reset();
+      m_own.assign(nPoints()*nOut(), 0);
+      m_table = m_own.data();
+
+      return 0;
+   }
+
+   size_t nAxes() const
+   {
+      return m_axes.size();
+   }
+
+   const std::string & axisName( size_t a ) const
+   {
+      return m_axisNames[a];
+   }
+
+   const std::vector<realT> & axis( size_t a ) const
+   {
+      return m_axes[a];
+   }
+
+   size_t nOut() const
+   {
+      return m_outNames.size();
+   }
+
+   const std::string & outName( size_t o ) const
+   {
+      return m_outNames[o];
+   }
+
+   /// The number of grid points.
+   size_t nPoints() const
+   {
+      return (m_axes.size() == 0) ? 0 : m_stride[0]*m_axes[0].size();
+   }
+
+   /// Get the index of a grid point from the index on each axis.
+   size_t point( const std::vector<size_t> & idx ) const
+   {
+      size_t p = 0;
+      for(size_t a = 0; a < m_axes.size(); ++a) p += idx[a]*m_stride[a];
+      return p;
+   }
+
+   /// Get the parameters of a grid point.
+   void coords( std::vector<realT> & x,
+                size_t p
+              ) const
+   {
+      x.resize(m_axes.size());
+      for(size_t a = 0; a < m_axes.size(); ++a) x[a] = m_axes[a][ (p / m_stride[a]) % m_axes[a].size() ];
+   }
+
+   /// Set the outputs of a grid point, of a table built in memory.
+   void set( size_t p,        ///< [in] the grid point
+             const realT * out ///< [in] the nOut outputs, not logarithms
+           )
+   {
+      for(size_t o = 0; o < nOut(); ++o)
+      {
+         m_own[p*nOut() + o] = m_logOut[o] ? log( std::max(out[o], std::numeric_limits<realT>::min()) ) : out[o];
+      }
+   }
+
+   /// Interpolate the outputs at a point in the hypercube.
+   /** Coordinates outside an axis are clamped to its ends.
+     *
+     * \returns 0 if the point is inside the table
+     * \returns 1 if any coordinate was clamped
+     */
+   int query( realT * out,    ///< [out] the nOut interpolated outputs
+              const realT * x ///< [in] the value of each axis
+            ) const
+   {
+      int na = m_axes.size();
+
+      int active[maxAxes]; //The axes which are interpolated
+      realT frac[maxAxes];
+      int nActive = 0;
+      int clamped = 0;
+
+      size_t p0 = 0;
+      for(int a = 0; a < na; ++a)
+      {
+         const std::vector<realT> & ax = m_axes[a];
+         size_t n = ax.size();
+
+         if(x[a] < ax[0] || x[a] > ax[n-1]) clamped = 1;
+         if(n == 1) continue;
+
+         size_t i;
+         realT f;
+         if(x[a] <= ax[0])
+         {
+            i = 0;
+            f = 0;
+         }
+         else if(x[a] >= ax[n-1])
+         {
+            i = n - 2;
+            f = 1;
+         }
+         else
+         {
+            i = std::upper_bound(ax.begin(), ax.end(), x[a]) - ax.begin() - 1;
+            f = (x[a] - ax[i])/(ax[i+1] - ax[i]);
+         }
+
+         p0 += i*m_stride[a];
+         active[nActive] = a;
+         frac[nActive] = f;
+         ++nActive;
+      }
+
+      size_t no = nOut();
+      for(size_t o = 0; o < no; ++o) out[o] = 0;
+
+      //Sum over the 2^nActive corners of the cell
+      for(int c = 0; c < (1 << nActive); ++c)
+      {
+         realT w = 1;
+         size_t p = p0;
+         for(int k = 0; k < nActive; ++k)
+         {
+            if(c & (1 << k))
+            {
+               w *= frac[k];
+               p += m_stride[active[k]];
+            }
+            else w *= (1 - frac[k]);
+         }
+
+         if(w == 0) continue;
+
+         const realT * v = m_table + p*no;
+         for(size_t o = 0; o < no; ++o) out[o] += w*v[o];
+      }
+
+      //Zeros are stored as the log of the smallest normal value, so values near it are returned as 0
+      for(size_t o = 0; o < no; ++o)
+      {
+         if(!m_logOut[o]) continue;
+
+         out[o] = exp(out[o]);
+         if(out[o] < 2*std::numeric_limits<realT>::min()) out[o] = 0;
+      }
+
+      return clamped;
+   }
+
+   /// Write the table.
+   /**
+     * \returns 0 on success
+     * \returns -1 on error
+     */
+   int save( const std::string & fileName ) const
+   {
+      snapshotWriter sw(sizeof(realT), SURROGATE_MAGIC, SURROGATE_VERSION);
+
+      sw.put<uint32_t>(m_axes.size());
+      for(size_t a = 0; a < m_axes.size(); ++a)
+      {
+         sw.put(m_axisNames[a]);
+         sw.put(m_axes[a]);
+      }
+
+      sw.put<uint32_t>(m_outNames.size());
+      for(size_t o = 0; o < m_outNames.size(); ++o) sw.put(m_outNames[o]);
+      sw.put(m_logOut);
+
+      sw.putAligned(m_table, nPoints()*nOut());
+
+      return sw.write(fileName);
+   }
+
+   /// Memory-map a table written by save.
+   /**
+     * \returns 0 on success
+     * \returns -1 on error
+     */
+   int load( const std::string & fileName )
+   {
+      std::unique_ptr<snapshotReader> sr(new snapshotReader);
+      if(sr->open(fileName, sizeof(realT), SURROGATE_MAGIC, SURROGATE_VERSION) < 0) return -1;
+
+      //Everything is read and checked before the table is changed, so a failed load leaves it as it was
+      uint32_t na = 0, no = 0;
+      sr->get(na);
+      if(sr->bad() || na == 0 || na > (uint32_t) maxAxes)
+      {
+         std::cerr << "perfSurrogate::load: " << fileName << " has an invalid number of axes\n";
+         return -1;
+      }
+
+      std::vector<std::string> axisNames(na);
+      std::vector<std::vector<realT>> axes(na);
+      for(size_t a = 0; a < na; ++a)
+      {
+         sr->get(axisNames[a]);
+         sr->get(axes[a]);
+         if(sr->bad()) break;
+
+         if(axes[a].size() == 0 || !std::is_sorted(axes[a].begin(), axes[a].end()) ||
+                                   std::adjacent_find(axes[a].begin(), axes[a].end()) != axes[a].end())
+         {
+            std::cerr << "perfSurrogate::load: axis " << axisNames[a] << " in " << fileName << " is not strictly increasing\n";
+            return -1;
+         }
+      }
+
+      std::vector<std::string> outNames;
+      sr->get(no);
+      for(size_t o = 0; o < no && !sr->bad(); ++o)
+      {
+         std::string name;
+         sr->get(name);
+         outNames.push_back(name);
+      }
+
+      std::vector<char> logOut;
+      sr->get(logOut);
+
+      const realT * table;
+      uint64_t n;
+      sr->view(table, n);
+
+      //The number of values the axes and outputs call for
+      size_t nPts = 1;
+      for(size_t a = 0; a < axes.size(); ++a) nPts *= axes[a].size();
+
+      if(sr->bad() || logOut.size() != no || n != nPts*no)
+      {
+         std::cerr << "perfSurrogate::load: " << fileName << " is truncated or corrupt\n";
+         return -1;
+      }
+
+      m_axisNames = std::move(axisNames);
+      m_axes = std::move(axes);
+      m_outNames = std::move(outNames);
+      m_logOut = std::move(logOut);
+      setStrides();
+
+      m_own.clear();
+      m_table = table;
+      m_map = std::move(sr);
+
+      return 0;
+   }
+};
+
+#endif //perfSurrogate_hpp
@@ -0,0 +1,340 @@
+/** \file psdGrid.hpp
+  * \brief Reading and writing the per-mode files of a temporal PSD grid.
+  *
+  */
+
+#ifndef psdGrid_hpp
+#define psdGrid_hpp
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include <Eigen/Dense>
+
+#include <mx/ioutils/binVector.hpp>
+#include <mx/ioutils/stringUtils.hpp>
+
+#include "fitsTiles.hpp"
+
+/// How the PSD of each mode in a grid is stored.
+/** With format binv each PSD is written with mx::ioutils::writeBinVector, as read by fourierTemporalPSD::analyzePSDGrid.
+  * With format fits each PSD is a 1-D FITS image, optionally tile-compressed as described for fitsTileFile.
+  * With precision float the PSDs are stored as single precision, and are converted back when read.
+  *
+  * The PSDs scale as r_0^(-5/3), so a grid records the r_0 at lam_0 it was calculated for, and can be rescaled to any other.
+  * A normalized grid stores the PSDs for r_0 = 1 m.
+  *
+  * A layered grid stores the PSD of each atmospheric layer separately, unweighted, so that the total
+  * PSD for any Cn^2 profile is the weighted sum of the layers.  The weights the grid was calculated for are recorded.
+  *
+  * The format of a grid is recorded in its format.txt file.  A grid without one is binv in double precision, with r_0 unknown.
+  */
+struct psdGridFormat
+{
+   std::string format {"binv"}; ///< The file format, binv or fits.
+   std::string precision {"double"}; ///< The storage precision, double or float.
+   std::string compress {"none"}; ///< The FITS compression, none, rice, gzip, or gzip2.
+   float quantize {0}; ///< The FITS quantize level, 0 for lossless.
+   bool normalized {false}; ///< Whether the PSDs are stored for r_0 = 1 m.
+   double r_0 {0}; ///< Fried's parameter of the stored PSDs [m], 1 if normalized, 0 if unknown.
+   double lam_0 {0}; ///< The wavelength at which r_0 is specified [m].
+   int layers {0}; ///< The number of layers stored separately, 0 if only the total is stored.
+   std::vector<double> layerCn2; ///< The Cn^2 weight of each layer the grid was calculated for.
+};
+
+/// Write format.txt to a grid directory.
+inline int writeGridFormat( const std::string & dir,
+                            const psdGridFormat & fmt
+                          )
+{
+   std::ofstream fout;
+   fout.open(dir + "/format.txt");
+
+   if(!fout.good())
+   {
+      std::cerr << "writeGridFormat: error writing " << dir << "/format.txt\n";
+      return -1;
+   }
+
+   fout << "format " << fmt.format << "\n";
+   fout << "precision " << fmt.precision << "\n";
+   fout << "compress " << fmt.compress << "\n";
+   fout << "quantize " << fmt.quantize << "\n";
+   fout << "normalized " << fmt.normalized << "\n";
+   fout.precision(17);
+   fout << "r_0 " << fmt.r_0 << "\n";
+   fout << "lam_0 " << fmt.lam_0 << "\n";
+   fout << "layers " << fmt.layers << "\n";
+   if(fmt.layers > 0)
+   {
+      fout << "layerCn2";
+      for(size_t i=0; i < fmt.layerCn2.size(); ++i) fout << " " << fmt.layerCn2[i];
+      fout << "\n";
+   }
+
+   return 0;
+}
+
+/// Read format.txt from a grid directory, if it exists.
+inline int readGridFormat( psdGridFormat & fmt,
+                           const std::string & dir
+                         )
+{
+   fmt = psdGridFormat();
+
+   std::ifstream fin;
+   fin.open(dir + "/format.txt");
+
+   if(!fin.good()) return 0; //A grid from before format.txt
+
+   std::string key;
+   while(fin >> key)
+   {
+      if(key == "format") fin >> fmt.format;
+      else if(key == "precision") fin >> fmt.precision;
+      else if(key == "compress") fin >> fmt.compress;
+      else if(key == "quantize") fin >> fmt.quantize;
+      else if(key == "normalized") fin >> fmt.normalized;
+      else if(key == "r_0") fin >> fmt.r_0;
+      else if(key == "lam_0") fin >> fmt.lam_0;
+      else if(key == "layers") fin >> fmt.layers;
+      else if(key == "layerCn2")
+      {
+         //layers is written first
+         fmt.layerCn2.resize(fmt.layers);
+         for(int i=0; i < fmt.layers; ++i) fin >> fmt.layerCn2[i];
+      }
+      else
+      {
+         std::string val;
+         fin >> val;
+      }
+   }
+
+   return 0;
+}
+
+/// Get the name of the file for the PSD of mode (m,n), without extension.
+inline std::string psdGridFileBase( const std::string & dir,
+                                    int m,
+                                    int n,
+                                    int layer = -1 ///< [in] the layer of a layered grid, or -1 for the total
+                                  )
+{
+   std::string base = dir + "/psd_" + mx::ioutils::convertToString(m) + "_" + mx::ioutils::convertToString(n);
+   
+   if(layer >= 0) base += "_L" + mx::ioutils::convertToString(layer);
+   
+   return base;
+}
+
+/// Write the PSD of mode (m,n) to a grid, with the storage type dataT.
+template<typename dataT, typename realT>
+int writeGridPSDAs( const std::string & dir,
+                    int m,
+                    int n,
+                    std::vector<realT> & psd,
+                    const psdGridFormat & fmt,
+                    int layer = -1
+                  )
+{
+   std::string base = psdGridFileBase(dir, m, n, layer);
+
+   std::vector<dataT> dpsd(psd.begin(), psd.end());
+
+   if(fmt.format == "binv")
+   {
+      if( mx::ioutils::writeBinVector(base + ".binv", dpsd) < 0)
+      {
+         std::cerr << "writeGridPSD: error writing " << base << ".binv\n";
+         return -1;
+      }
+      return 0;
+   }
+
+   if(fmt.format == "fits")
+   {
+      Eigen::Map<Eigen::Array<dataT,-1,-1>> im(dpsd.data(), dpsd.size(), 1);
+
+      fitsTileFile<dataT> ff;
+      if(ff.compression(fmt.compress, fmt.quantize) < 0) return -1;
+
+      return ff.writeImage(base + ".fits", im);
+   }
+
+   std::cerr << "writeGridPSD: unknown grid format " << fmt.format << "\n";
+   return -1;
+}
+
+/// Write the PSD of mode (m,n) to a grid, in the precision set by fmt.
+template<typename realT>
+int writeGridPSD( const std::string & dir,
+                  int m,
+                  int n,
+                  std::vector<realT> & psd,
+                  const psdGridFormat & fmt,
+                  int layer = -1 ///< [in] the layer of a layered grid, or -1 for the total
+                )
+{
+   if(fmt.precision == "float") return writeGridPSDAs<float>(dir, m, n, psd, fmt, layer);
+
+   return writeGridPSDAs<realT>(dir, m, n, psd, fmt, layer);
+}
+
+/// Read the PSD of mode (m,n) from a grid.
+/** The PSD is converted to realT, whatever the storage precision.  Compressed FITS files are decompressed by cfitsio.
+  */
+template<typename realT>
+int readGridPSD( std::vector<realT> & psd,
+                 const std::string & dir,
+                 int m,
+                 int n,
+                 const psdGridFormat & fmt,
+                 int layer = -1 ///< [in] the layer of a layered grid, or -1 for the total
+               )
+{
+   std::string base = psdGridFileBase(dir, m, n, layer);
+
+   if(fmt.format == "binv")
+   {
+      int rv;
+      if(fmt.precision == "float")
+      {
+         std::vector<float> fpsd;
+         rv = mx::ioutils::readBinVector(fpsd, base + ".binv");
+         psd.assign(fpsd.begin(), fpsd.end());
+      }
+      else rv = mx::ioutils::readBinVector(psd, base + ".binv");
+
+      if(rv < 0)
+      {
+         std::cerr << "readGridPSD: error reading " << base << ".binv\n";
+         return -1;
+      }
+      return 0;
+   }
+
+   fitsTileFile<realT> ff;
+   if(ff.open(base + ".fits") < 0) return -1;
+
+   psd.resize(ff.rows()*ff.cols());
+   Eigen::Map<Eigen::Array<realT,-1,-1>> im(psd.data(), ff.rows(), ff.cols());
+
+   return ff.readTile(im, 0, 0);
+}
+
+/// Rescale the temporal PSD of a mode for layer wind speeds changed by a common factor.
+/** For frozen flow, scaling every wind speed by s gives PSD_s(f) = PSD(f/s)/s, which conserves the variance.  The
+  * stored PSD is resampled at f/s by interpolating linearly in log(f) and log(PSD), or linearly where a value is not positive.
+  * Below the first stored frequency the PSD is held constant, as it is flat at low frequency.  Above the last it is
+  * extrapolated as a power law fit by least squares in log-log over the top 10% of the stored frequencies, so no
+  * single noisy sample sets the tail.
+  *
+  * For s > 1 the stored power between freq[N-1]/s and freq[N-1] moves above the last frequency and is dropped.  Its
+  * fraction of the stored variance is returned in truncated, which is 0 for s <= 1.
+  *
+  * \returns the fraction of the rescaled variance that is in the extrapolated tail
+  */
+template<typename realT>
+realT rescaleWindPSD( std::vector<realT> & out,         ///< [out] the rescaled PSD, at freq
+                      realT & truncated,                ///< [out] the fraction of the stored variance dropped above the last frequency
+                      const std::vector<realT> & freq,  ///< [in] the frequencies, ascending and > 0
+                      const std::vector<realT> & psd,   ///< [in] the stored PSD
+                      realT scale                       ///< [in] the wind speed scale factor s
+                    )
+{
+   size_t N = freq.size();
+   out.resize(N);
+   truncated = 0;
+
+   if(scale == 1)
+   {
+      out = psd;
+      return 0;
+   }
+
+   if(scale > 1)
+   {
+      realT stored = 0, dropped = 0;
+      for(size_t i = 0; i < N; ++i)
+      {
+         stored += psd[i];
+         if(freq[i] > freq[N-1]/scale) dropped += psd[i];
+      }
+      if(stored > 0) truncated = dropped/stored;
+   }
+
+   //Power law slope of the tail, by least squares in log-log over the positive values of the top 10%
+   size_t i0 = N - std::max<size_t>(N/10, 2);
+   realT slope = 0;
+   realT tail0 = psd[N-1]; //The tail's value at the last frequency
+   realT sx = 0, sy = 0, sxx = 0, sxy = 0;
+   size_t nfit = 0;
+   for(size_t i = i0; i < N; ++i)
+   {
+      if(psd[i] <= 0) continue;
+
+      realT x = log(freq[i]);
+      realT y = log(psd[i]);
+      sx += x;
+      sy += y;
+      sxx += x*x;
+      sxy += x*y;
+      ++nfit;
+   }
+   if(nfit >= 2 && nfit*sxx - sx*sx > 0)
+   {
+      slope = (nfit*sxy - sx*sy)/(nfit*sxx - sx*sx);
+      if(slope > 0) slope = 0;
+
+      tail0 = exp( (sy - slope*sx)/nfit + slope*log(freq[N-1]) );
+   }
+
+   realT var = 0, tailVar = 0;
+
+   size_t j = 0;
+   for(size_t i = 0; i < N; ++i)
+   {
+      realT f = freq[i]/scale;
+      realT p;
+
+      if(f <= freq[0])
+      {
+         p = psd[0];
+      }
+      else if(f >= freq[N-1])
+      {
+         p = tail0*pow(f/freq[N-1], slope);
+         tailVar += p/scale;
+      }
+      else
+      {
+         //freq is ascending, and so is f
+         while(freq[j+1] < f) ++j;
+
+         if(psd[j] > 0 && psd[j+1] > 0)
+         {
+            realT x = log(f/freq[j])/log(freq[j+1]/freq[j]);
+            p = psd[j]*pow(psd[j+1]/psd[j], x);
+         }
+         else
+         {
+            realT x = (f - freq[j])/(freq[j+1] - freq[j]);
+            p = (1-x)*psd[j] + x*psd[j+1];
+         }
+      }
+
+      out[i] = p/scale;
+      var += out[i];
+   }
+
+   if(var <= 0) return 0;
+
+   return tailVar/var;
+}
+
+#endif //psdGrid_hpp
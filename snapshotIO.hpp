@@ -0,0 +1,253 @@
+/** \file snapshotIO.hpp
+  * \brief A versioned binary format for saving and memory-mapping back a configured system.
+  *
+  */
+
+#ifndef snapshotIO_hpp
+#define snapshotIO_hpp
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_MAGIC "mxAOSnap"
+#define SNAPSHOT_VERSION 1
+
+/// Builds a snapshot in memory and writes it to disk.
+/** The file starts with the 8 byte magic string, then the format version and the size of realT, each as uint32_t.
+  * Each value follows in the order written: scalars as raw bytes, and vectors and strings as a uint64_t
+  * length followed by the elements.  Arrays written with putAligned are padded after the length so the elements
+  * are aligned in the file, and so can be used in place from the mapping.  Other formats use the same layout with
+  * their own magic string and version.
+  */
+class snapshotWriter
+{
+protected:
+   std::vector<char> m_buff;
+
+public:
+   snapshotWriter( uint32_t realSize,
+                   const char * magic = SNAPSHOT_MAGIC, ///< [in] the 8 byte magic string of the format
+                   uint32_t version = SNAPSHOT_VERSION  ///< [in] the version of the format
+                 )
+   {
+      m_buff.insert(m_buff.end(), magic, magic + 8);
+      put<uint32_t>(version);
+      put<uint32_t>(realSize);
+   }
+
+   template<typename T>
+   void put( const T & val )
+   {
+      const char * p = reinterpret_cast<const char *>(&val);
+      m_buff.insert(m_buff.end(), p, p + sizeof(T));
+   }
+
+   template<typename T>
+   void put( const std::vector<T> & vec )
+   {
+      put<uint64_t>(vec.size());
+      const char * p = reinterpret_cast<const char *>(vec.data());
+      m_buff.insert(m_buff.end(), p, p + vec.size()*sizeof(T));
+   }
+
+   void put( const std::string & str )
+   {
+      put<uint64_t>(str.size());
+      m_buff.insert(m_buff.end(), str.begin(), str.end());
+   }
+
+   /// Write an array with its elements aligned in the file, to be read in place with snapshotReader::view.
+   template<typename T>
+   void putAligned( const T * data,
+                    uint64_t n
+                  )
+   {
+      put<uint64_t>(n);
+      m_buff.resize( ((m_buff.size() + alignof(T) - 1)/alignof(T))*alignof(T), 0);
+      const char * p = reinterpret_cast<const char *>(data);
+      m_buff.insert(m_buff.end(), p, p + n*sizeof(T));
+   }
+
+   int write( const std::string & fileName )
+   {
+      FILE * fout = fopen(fileName.c_str(), "wb");
+      if(fout == nullptr)
+      {
+         std::cerr << "snapshotWriter: error opening " << fileName << "\n";
+         return -1;
+      }
+
+      size_t nw = fwrite(m_buff.data(), 1, m_buff.size(), fout);
+      fclose(fout);
+
+      if(nw != m_buff.size())
+      {
+         std::cerr << "snapshotWriter: error writing " << fileName << "\n";
+         return -1;
+      }
+
+      return 0;
+   }
+};
+
+/// Memory-maps a snapshot and reads its values in order.
+class snapshotReader
+{
+protected:
+   const char * m_map {nullptr};
+   size_t m_size {0};
+   size_t m_pos {0};
+   bool m_bad {false};
+
+   bool check( size_t n )
+   {
+      if(m_bad || n > m_size - m_pos) m_bad = true;
+      return !m_bad;
+   }
+
+public:
+
+   ~snapshotReader()
+   {
+      if(m_map) munmap( (void *) m_map, m_size);
+   }
+
+   /// Map the file and check its header.
+   int open( const std::string & fileName,
+             uint32_t realSize,
+             const char * magic = SNAPSHOT_MAGIC, ///< [in] the 8 byte magic string of the format
+             uint32_t maxVersion = SNAPSHOT_VERSION ///< [in] the newest version of the format which can be read
+           )
+   {
+      int fd = ::open(fileName.c_str(), O_RDONLY);
+      if(fd < 0)
+      {
+         std::cerr << "snapshotReader: error opening " << fileName << "\n";
+         return -1;
+      }
+
+      struct stat st;
+      if(fstat(fd, &st) < 0 || st.st_size < 16)
+      {
+         ::close(fd);
+         std::cerr << "snapshotReader: " << fileName << " is not a snapshot\n";
+         return -1;
+      }
+
+      m_size = st.st_size;
+      void * map = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+
+      if(map == MAP_FAILED)
+      {
+         std::cerr << "snapshotReader: error mapping " << fileName << "\n";
+         return -1;
+      }
+      m_map = (const char *) map;
+
+      if(memcmp(m_map, magic, 8) != 0)
+      {
+         std::cerr << "snapshotReader: " << fileName << " is not a " << std::string(magic, 8) << " file\n";
+         return -1;
+      }
+      m_pos = 8;
+
+      uint32_t version = 0, rs = 0;
+      get(version);
+      get(rs);
+
+      if(m_bad)
+      {
+         std::cerr << "snapshotReader: " << fileName << " is truncated\n";
+         return -1;
+      }
+
+      if(version > maxVersion)
+      {
+         std::cerr << "snapshotReader: " << fileName << " has version " << version << ", newer than " << maxVersion << "\n";
+         return -1;
+      }
+
+      if(rs != realSize)
+      {
+         std::cerr << "snapshotReader: " << fileName << " was written with a different real type\n";
+         return -1;
+      }
+
+      return 0;
+   }
+
+   template<typename T>
+   void get( T & val )
+   {
+      if(!check(sizeof(T))) return;
+      memcpy(&val, m_map + m_pos, sizeof(T));
+      m_pos += sizeof(T);
+   }
+
+   template<typename T>
+   void get( std::vector<T> & vec )
+   {
+      uint64_t n = 0;
+      get(n);
+      if(m_bad || n > (m_size - m_pos)/sizeof(T))
+      {
+         m_bad = true;
+         return;
+      }
+      vec.resize(n);
+      memcpy(vec.data(), m_map + m_pos, n*sizeof(T));
+      m_pos += n*sizeof(T);
+   }
+
+   void get( std::string & str )
+   {
+      uint64_t n = 0;
+      get(n);
+      if(!check(n)) return;
+      str.assign(m_map + m_pos, n);
+      m_pos += n;
+   }
+
+   /// Get a pointer to an array written with putAligned, in place in the mapping.
+   /** The pointer is valid for the lifetime of the reader.
+     */
+   template<typename T>
+   void view( const T * & data,
+              uint64_t & n
+            )
+   {
+      data = nullptr;
+      n = 0;
+
+      uint64_t len = 0;
+      get(len);
+
+      size_t pos = ((m_pos + alignof(T) - 1)/alignof(T))*alignof(T);
+      if(m_bad || pos > m_size || len > (m_size - pos)/sizeof(T))
+      {
+         m_bad = true;
+         return;
+      }
+
+      data = reinterpret_cast<const T *>(m_map + pos);
+      n = len;
+      m_pos = pos + len*sizeof(T);
+   }
+
+   /// Check whether any read went past the end of the file.
+   bool bad()
+   {
+      return m_bad;
+   }
+};
+
+#endif //snapshotIO_hpp
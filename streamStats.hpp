@@ -0,0 +1,168 @@
+/** \file streamStats.hpp
+  * \brief Statistics and quantiles of a stream of values, in constant memory.
+  *
+  */
+
+#ifndef streamStats_hpp
+#define streamStats_hpp
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+/// The count, mean, variance, and range of a stream of values, by Welford's method.
+template<typename realT>
+class runningStats
+{
+protected:
+   size_t m_n {0};
+   realT m_mean {0};
+   realT m_M2 {0};
+   realT m_min {std::numeric_limits<realT>::max()};
+   realT m_max {std::numeric_limits<realT>::lowest()};
+
+public:
+
+   void add( realT x )
+   {
+      ++m_n;
+      realT d = x - m_mean;
+      m_mean += d/m_n;
+      m_M2 += d*(x - m_mean);
+
+      if(x < m_min) m_min = x;
+      if(x > m_max) m_max = x;
+   }
+
+   size_t n() const
+   {
+      return m_n;
+   }
+
+   realT mean() const
+   {
+      return m_mean;
+   }
+
+   /// The sample variance.
+   realT variance() const
+   {
+      return (m_n > 1) ? m_M2/(m_n - 1) : 0;
+   }
+
+   realT min() const
+   {
+      return m_min;
+   }
+
+   realT max() const
+   {
+      return m_max;
+   }
+};
+
+/// Estimates one quantile of a stream of values with the P^2 algorithm of Jain & Chlamtac (1985).
+/** Five markers are kept, at the minimum, the quantile, the quantile's halfway points to each end, and the maximum.
+  * Their heights are adjusted by piecewise-parabolic interpolation as values arrive, so the memory is constant.  The
+  * estimate depends on the order of the values, so streams should be fed in a fixed order for reproducible results.
+  */
+template<typename realT>
+class p2Quantile
+{
+protected:
+   realT m_p; ///< The quantile, in [0,1].
+   size_t m_n {0};
+   realT m_q[5]; ///< Marker heights
+   realT m_pos[5]; ///< Marker positions
+   realT m_des[5]; ///< Desired marker positions
+   realT m_inc[5]; ///< Increments of the desired positions
+
+public:
+
+   explicit p2Quantile( realT p = 0.5 /**< [in] the quantile, in [0,1] */ ) : m_p(p)
+   {
+      for(int i = 0; i < 5; ++i) m_pos[i] = i + 1;
+
+      m_des[0] = 1;
+      m_des[1] = 1 + 2*p;
+      m_des[2] = 1 + 4*p;
+      m_des[3] = 3 + 2*p;
+      m_des[4] = 5;
+
+      m_inc[0] = 0;
+      m_inc[1] = p/2;
+      m_inc[2] = p;
+      m_inc[3] = (1 + p)/2;
+      m_inc[4] = 1;
+   }
+
+   void add( realT x )
+   {
+      if(m_n < 5)
+      {
+         m_q[m_n] = x;
+         ++m_n;
+         if(m_n == 5) std::sort(m_q, m_q + 5);
+         return;
+      }
+      ++m_n;
+
+      //The cell of x, extending the ends
+      int k;
+      if(x < m_q[0])
+      {
+         m_q[0] = x;
+         k = 0;
+      }
+      else if(x >= m_q[4])
+      {
+         m_q[4] = x;
+         k = 3;
+      }
+      else
+      {
+         k = 0;
+         while(x >= m_q[k+1]) ++k;
+      }
+
+      for(int i = k+1; i < 5; ++i) m_pos[i] += 1;
+      for(int i = 0; i < 5; ++i) m_des[i] += m_inc[i];
+
+      //Move the middle markers toward their desired positions
+      for(int i = 1; i < 4; ++i)
+      {
+         realT d = m_des[i] - m_pos[i];
+
+         if( (d >= 1 && m_pos[i+1] - m_pos[i] > 1) || (d <= -1 && m_pos[i-1] - m_pos[i] < -1) )
+         {
+            int s = (d > 0) ? 1 : -1;
+
+            realT qp = m_q[i] + s/(m_pos[i+1] - m_pos[i-1]) * ( (m_pos[i] - m_pos[i-1] + s)*(m_q[i+1] - m_q[i])/(m_pos[i+1] - m_pos[i])
+                                                              + (m_pos[i+1] - m_pos[i] - s)*(m_q[i] - m_q[i-1])/(m_pos[i] - m_pos[i-1]) );
+
+            if(m_q[i-1] < qp && qp < m_q[i+1]) m_q[i] = qp;
+            else m_q[i] += s*(m_q[i+s] - m_q[i])/(m_pos[i+s] - m_pos[i]);
+
+            m_pos[i] += s;
+         }
+      }
+   }
+
+   /// The current estimate of the quantile.
+   realT value() const
+   {
+      if(m_n == 0) return 0;
+
+      if(m_n < 5)
+      {
+         std::vector<realT> q(m_q, m_q + m_n);
+         std::sort(q.begin(), q.end());
+         return q[ (size_t) std::round(m_p*(m_n - 1)) ];
+      }
+
+      return m_q[2];
+   }
+};
+
+#endif //streamStats_hpp
@@ -0,0 +1,117 @@
+/** \file systemSnapshot.hpp
+  * \brief Immutable, shareable snapshots of a configured AO system for concurrent evaluation.
+  *
+  */
+
+#ifndef systemSnapshot_hpp
+#define systemSnapshot_hpp
+
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <utility>
+#include <unordered_map>
+
+/// An immutable snapshot of a configured AO system, which many threads can query at once without locks.
+/** The system is held by a shared pointer to const, so copies of a snapshot are cheap and share it, and no one can change it.
+  * Variants are made with derive, which copies the system once and applies the overrides, e.g.
+  * \code
+  * auto faint = snap.derive( [](aosysT & s){ s.starMag(12); } );
+  * \endcode
+  *
+  * The error and contrast functions of the system are not const, since the library may update internal state when
+  * queried.  So queries are made through eval, which passes a private copy owned by the calling thread.  Each thread keeps
+  * one copy per snapshot it has queried, made on its first query of that snapshot, so interleaved queries of several
+  * snapshots do not recopy.  Copies of snapshots which no longer exist are dropped when a thread makes a new copy.  The
+  * copies are thread-local, so no query locks.  Since the copy is reused, eval must not be used to change parameters,
+  * which is what derive is for.
+  */
+template<typename aosysT>
+class aosysSnapshot
+{
+protected:
+   std::shared_ptr<const aosysT> m_sys;
+   uint64_t m_id {0};
+
+   static uint64_t nextId()
+   {
+      static std::atomic<uint64_t> id {1};
+      return id++;
+   }
+
+   explicit aosysSnapshot( std::shared_ptr<const aosysT> sys ) : m_sys(std::move(sys)), m_id(nextId())
+   {
+   }
+
+   /// The calling thread's private copy of this snapshot's system, made on first use.
+   aosysT & localCopy() const
+   {
+      struct copyT
+      {
+         std::weak_ptr<const aosysT> source; ///< Expires when the last copy of the snapshot is destroyed
+         std::unique_ptr<aosysT> sys;
+      };
+
+      thread_local std::unordered_map<uint64_t, copyT> copies;
+
+      auto it = copies.find(m_id);
+      if(it != copies.end()) return *it->second.sys;
+
+      //Drop the copies of snapshots which are gone before adding one
+      for(auto e = copies.begin(); e != copies.end(); )
+      {
+         if(e->second.source.expired()) e = copies.erase(e);
+         else ++e;
+      }
+
+      copyT & c = copies[m_id];
+      c.source = m_sys;
+      c.sys.reset(new aosysT(*m_sys));
+
+      return *c.sys;
+   }
+
+public:
+
+   aosysSnapshot()
+   {
+   }
+
+   /// Take a snapshot of a configured system.
+   explicit aosysSnapshot( const aosysT & sys ) : aosysSnapshot( std::make_shared<const aosysT>(sys) )
+   {
+   }
+
+   /// Check whether the snapshot holds a system.
+   bool valid() const
+   {
+      return (m_sys != nullptr);
+   }
+
+   /// Read-only access to the system, e.g. for getters, or to copy it.
+   const aosysT & get() const
+   {
+      return *m_sys;
+   }
+
+   /// Make a new snapshot with some parameters overridden.
+   template<typename modT>
+   aosysSnapshot derive( modT && mod /**< [in] function with signature void(aosysT &) which sets the overrides */ ) const
+   {
+      std::shared_ptr<aosysT> sys = std::make_shared<aosysT>(*m_sys);
+      mod(*sys);
+      return aosysSnapshot( std::shared_ptr<const aosysT>(std::move(sys)) );
+   }
+
+   /// Query the system on the calling thread's private copy.
+   /**
+     * \returns the result of func
+     */
+   template<typename funcT>
+   auto eval( funcT && func /**< [in] function with signature result(aosysT &), which must not change parameters */ ) const -> decltype(func(std::declval<aosysT &>()))
+   {
+      return func(localCopy());
+   }
+};
+
+#endif //systemSnapshot_hpp
@@ -0,0 +1,161 @@
+/** \file taskBudget.hpp
+  * \brief The thread and memory budgets shared by all parallel work in the app.
+  *
+  */
+
+#ifndef taskBudget_hpp
+#define taskBudget_hpp
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <cctype>
+#include <mutex>
+#include <condition_variable>
+
+#include <omp.h>
+
+/// Set the number of worker threads used by all parallel regions.
+/** Parallel loops are scheduled dynamically, so idle threads take the next task.  Only the outermost
+  * parallel region is active, so a parallel loop reached from inside another (e.g. a bandpass over a map
+  * calculated with a threaded library) runs on the calling thread instead of oversubscribing the cores.
+  */
+inline void setThreadBudget( int threads /**< [in] the number of threads, if <= 0 the OpenMP default is used. */ )
+{
+   if(threads > 0) omp_set_num_threads(threads);
+
+   omp_set_max_active_levels(1);
+}
+
+/// Parse a memory size, with an optional K, M, G, or T suffix (powers of 1024).
+/**
+  * \returns 0 on success, with size set to the size in bytes, where 0 means unlimited
+  * \returns -1 if the string is not a valid size
+  */
+inline int parseMemorySize( size_t & size,            ///< [out] the size in bytes
+                            const std::string & str   ///< [in] the size, e.g. 512M or 16G
+                          )
+{
+   size = 0;
+   if(str == "") return 0;
+
+   char * end;
+   double val = strtod(str.c_str(), &end);
+
+   std::string units = "KMGT";
+   size_t p = (*end == '\0') ? std::string::npos : units.find(toupper(*end));
+
+   if(end == str.c_str() || val < 0 || (*end != '\0' && (p == std::string::npos || *(end+1) != '\0')))
+   {
+      std::cerr << "parseMemorySize: invalid memory size " << str << "\n";
+      return -1;
+   }
+
+   if(p != std::string::npos)
+   {
+      for(size_t i=0; i <= p; ++i) val *= 1024;
+   }
+
+   size = val;
+   return 0;
+}
+
+/// Limits the memory held by concurrent tasks.
+/** A task acquires its bytes before allocating and releases them when its data is freed, which may be on
+  * another thread (e.g. after an asynchronous write).  acquire blocks while the budget is exhausted.  A
+  * request larger than the whole budget is allowed once nothing else is held, so it cannot deadlock.
+  *
+  * Only temporalPSDGrid is throttled, as its PSDs wait on the writer thread.  The other modes run one task at a time,
+  * so there is nothing to wait for.  They check fits first and refuse a task larger than the budget, and a
+  * caller which already holds bytes uses tryAcquire, which refuses instead of blocking.
+  */
+class memoryBudget
+{
+protected:
+   size_t m_max {0};
+   size_t m_used {0};
+
+   std::mutex m_mutex;
+   std::condition_variable m_freed;
+
+public:
+
+   /// Set the budget [bytes], 0 for unlimited.
+   void max( size_t mx )
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_max = mx;
+   }
+
+   /// Get the budget [bytes], 0 for unlimited.
+   size_t max()
+   {
+      return m_max;
+   }
+
+   /// Check whether a single allocation of this size fits in the budget at all.
+   bool fits( size_t bytes )
+   {
+      return (m_max == 0 || bytes <= m_max);
+   }
+
+   /// Reserve bytes, blocking until they are available.
+   void acquire( size_t bytes )
+   {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      if(m_max > 0) m_freed.wait(lock, [&]{ return m_used == 0 || m_used + bytes <= m_max; });
+      m_used += bytes;
+   }
+
+   /// Reserve bytes only if they are available now.
+   /** For a task which already holds part of the budget, where blocking on itself would deadlock.
+     *
+     * \returns true if the bytes were reserved
+     * \returns false otherwise
+     */
+   bool tryAcquire( size_t bytes )
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if(m_max > 0 && m_used > 0 && m_used + bytes > m_max) return false;
+      m_used += bytes;
+      return true;
+   }
+
+   /// Return bytes reserved with acquire or tryAcquire.
+   void release( size_t bytes )
+   {
+      {
+         std::lock_guard<std::mutex> lock(m_mutex);
+         m_used -= (bytes < m_used) ? bytes : m_used;
+      }
+      m_freed.notify_all();
+   }
+};
+
+/// Holds bytes of a memoryBudget for its lifetime, for allocations which last the rest of a scope.
+class memoryLease
+{
+protected:
+   memoryBudget & m_budget;
+   size_t m_bytes;
+
+public:
+
+   /// Acquire bytes, blocking until they are available.
+   memoryLease( memoryBudget & budget, ///< [in] the budget
+                size_t bytes           ///< [in] the bytes to hold
+              ) : m_budget(budget), m_bytes(bytes)
+   {
+      m_budget.acquire(m_bytes);
+   }
+
+   memoryLease( const memoryLease & ) = delete;
+   memoryLease & operator=( const memoryLease & ) = delete;
+
+   ~memoryLease()
+   {
+      m_budget.release(m_bytes);
+   }
+};
+
+#endif //taskBudget_hpp